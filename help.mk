@@ -1,4 +1,5 @@
 HELP_MSG.my_grep            =	"My own grep-like utility for education"
+HELP_MSG.libglobmatch       =	"Library for matching glob patterns used by my_grep"
 HELP_MSG.libc_grep          =	"grep-like utility based on regcomp/regexec from libc"
 HELP_MSG.tre_grep           =	"grep-like utility based on regcomp/regexec from TRE"
 HELP_MSG.pcre2_grep         =	"grep-like utility based on regcomp/regexec from pcre2"
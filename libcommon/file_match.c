@@ -21,12 +21,31 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include "file_match.h"
 
+#define READ_BLOCK_SIZE (1024 * 1024)
+
+// file_follow() checks the file this often even if inotify(7)
+// reports nothing, e.g., file is replaced in other directory
+#define FOLLOW_POLL_INTERVAL_MS 1000
+
 void file_match(void (*match)(const char *), const char *filename)
 {
 	int reti;
@@ -64,39 +83,499 @@ void file_match(void (*match)(const char *), const char *filename)
 		fclose(file);
 }
 
-void file_match2(void (*match)(const char *, size_t), const char *filename)
+static void *xrealloc(void *ptr, size_t size)
 {
-	int reti;
-	char *line = NULL;
-	size_t len;
-	size_t line_len;
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+// Returns -1 if file cannot be opened, errno is set then
+static int open_file(const char *filename)
+{
+	if (!strcmp(filename, "-"))
+		return 0;
+
+	return open(filename, O_RDONLY);
+}
+
+// Callback receiving blocks of complete lines,
+// scanning stops if it returns non-zero
+typedef int (*block_func_t)(void *data, const char *buffer, size_t size);
+
+// Passes all lines found in block to match(). Lines are split
+// in place, that is, neither copied nor NUL-terminated.
+static int match_lines(void *data, const char *buffer, size_t size)
+{
+	void (*match)(const char *, size_t) =
+		*(void (**)(const char *, size_t)) data;
+	const char *end = buffer + size;
+	const char *eol;
+
+	while ((eol = memchr(buffer, '\n', end - buffer)) != NULL) {
+		match(buffer, eol - buffer);
+		buffer = eol + 1;
+	}
+
+	// the last line without trailing newline
+	if (buffer < end)
+		match(buffer, end - buffer);
+	return 0;
+}
+
+// Passes lines found in block to match_batch() by batches of up to
+// FILE_MATCH_BATCH_SIZE lines. Batch never spans blocks because
+// buffer may be reused for the next block.
+static int match_lines_batch(void *data, const char *buffer, size_t size)
+{
+	void (*match_batch)(const char **, const size_t *, size_t) =
+		*(void (**)(const char **, const size_t *, size_t)) data;
+	const char *lines[FILE_MATCH_BATCH_SIZE];
+	size_t line_lens[FILE_MATCH_BATCH_SIZE];
+	size_t count = 0;
+	const char *end = buffer + size;
+	const char *eol;
+
+	while (buffer < end) {
+		eol = memchr(buffer, '\n', end - buffer);
+		lines[count] = buffer;
+		line_lens[count] = (eol ? eol : end) - buffer;
+		buffer = (eol ? eol + 1 : end);
+
+		if (++count == FILE_MATCH_BATCH_SIZE) {
+			match_batch(lines, line_lens, count);
+			count = 0;
+		}
+	}
+
+	if (count > 0)
+		match_batch(lines, line_lens, count);
+	return 0;
+}
+
+// Returns offset of the first byte after the last newline in buffer
+static size_t complete_lines_size(const char *buffer, size_t size)
+{
+	while (size > 0 && buffer[size - 1] != '\n')
+		--size;
+	return size;
+}
+
+// Maps regular file into memory. Returns 0 if file cannot be mapped,
+// e.g., it is a pipe.
+static int map_fd(int fd, char **buffer, size_t *size)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+		return 0;
+	if ((unsigned long long)st.st_size > SIZE_MAX)
+		return 0;
+
+	*size = (size_t)st.st_size;
+	if (*size == 0) {
+		*buffer = NULL;
+		return 1;
+	}
+
+	*buffer = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (*buffer == MAP_FAILED)
+		return 0;
+
+	madvise(*buffer, *size, MADV_SEQUENTIAL);
+	return 1;
+}
+
+// Regular files are scanned without copying, mapped file is passed
+// to block() by newline-aligned blocks of about READ_BLOCK_SIZE bytes.
+// Returns 0 if file cannot be mapped.
+static int scan_mmap(block_func_t block, void *data, int fd)
+{
+	size_t size;
+	char *buffer;
+	const char *p;
+	const char *end;
+	const char *block_end;
+
+	if (!map_fd(fd, &buffer, &size))
+		return 0;
+	if (size == 0)
+		return 1;
+
+	p = buffer;
+	end = buffer + size;
+	while (p < end) {
+		block_end = end;
+		if ((size_t)(end - p) > READ_BLOCK_SIZE) {
+			block_end = memchr(p + READ_BLOCK_SIZE, '\n',
+				end - p - READ_BLOCK_SIZE);
+			block_end = (block_end ? block_end + 1 : end);
+		}
+
+		if (block(data, p, block_end - p))
+			break;
+		p = block_end;
+	}
+
+	munmap(buffer, size);
+	return 1;
+}
+
+// Pipes, terminals and stdin are read by large blocks. Unfinished
+// line is moved to the beginning of the buffer, so that block()
+// receives complete lines. Returns -1 on read error.
+static int scan_read(block_func_t block, void *data, int fd)
+{
+	size_t buffer_size = READ_BLOCK_SIZE;
+	size_t filled = 0;
+	size_t done;
 	ssize_t nread;
-	FILE *file = NULL;
+	int ret = 0;
+	int saved_errno;
+	char *buffer = xrealloc(NULL, buffer_size);
 
-	if (!strcmp(filename, "-")) {
-		file = stdin;
-	} else {
-		// Open the file
-		file = fopen(filename, "r");
-		if (!file) {
-			fprintf(stderr, "Could not open file: %s\n", filename);
-			exit(1);
+	while ((nread = read(fd, buffer + filled, buffer_size - filled)) != 0) {
+		if (nread == -1) {
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+
+		filled += nread;
+		done = complete_lines_size(buffer, filled);
+		if (done > 0) {
+			if (block(data, buffer, done)) {
+				filled = 0;
+				break;
+			}
+			filled -= done;
+			memmove(buffer, buffer + done, filled);
+		}
+
+		// line is longer than buffer
+		if (filled == buffer_size) {
+			buffer_size *= 2;
+			buffer = xrealloc(buffer, buffer_size);
 		}
 	}
 
-	// Read each line from the file and search for the pattern
-	while ((nread = getline(&line, &len, file)) != -1) {
-		// Remove newline character if present
-		line_len = strlen(line);
-		if (line[line_len - 1] == '\n') {
-			line[--line_len] = '\0';
+	// the last line without trailing newline
+	if (filled > 0)
+		block(data, buffer, filled);
+
+	saved_errno = errno;
+	free(buffer);
+	errno = saved_errno;
+	return ret;
+}
+
+static int scan_file(block_func_t block, void *data, const char *filename)
+{
+	int fd = open_file(filename);
+	int ret = 0;
+	int saved_errno;
+
+	if (fd == -1)
+		return -1;
+
+	if (!scan_mmap(block, data, fd))
+		ret = scan_read(block, data, fd);
+
+	// Close the file
+	saved_errno = errno;
+	if (fd != 0)
+		close(fd);
+	errno = saved_errno;
+	return ret;
+}
+
+int file_match2(void (*match)(const char *, size_t), const char *filename)
+{
+	return scan_file(match_lines, &match, filename);
+}
+
+int file_match2_batch(
+	void (*match_batch)(const char **, const size_t *, size_t),
+	const char *filename)
+{
+	return scan_file(match_lines_batch, &match_batch, filename);
+}
+
+// Passes data available in fd to read_block(). Returns 1 if
+// read_block() returns non-zero and -1 on read error.
+static int read_available(
+	int (*read_block)(const char *, size_t), int fd, char *buffer)
+{
+	ssize_t nread;
+
+	while ((nread = read(fd, buffer, READ_BLOCK_SIZE)) != 0) {
+		if (nread == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
 		}
+		if (read_block(buffer, nread))
+			return 1;
+	}
+	return 0;
+}
 
-		// Process line
-		match(line, line_len);
+struct read_until {
+	int (*read_block)(const char *, size_t);
+	int stopped;
+};
+
+static int pass_block_stopped(void *data, const char *buffer, size_t size)
+{
+	struct read_until *r = data;
+
+	r->stopped = r->read_block(buffer, size);
+	return r->stopped;
+}
+
+int file_read_blocks_until(
+	int (*read_block)(const char *, size_t), const char *filename)
+{
+	struct read_until r = {read_block, 0};
+	int fd = open_file(filename);
+	int saved_errno;
+	char *buffer;
+
+	if (fd == -1)
+		return -1;
+
+	if (!scan_mmap(pass_block_stopped, &r, fd)) {
+		buffer = xrealloc(NULL, READ_BLOCK_SIZE);
+		r.stopped = read_available(read_block, fd, buffer);
+		saved_errno = errno;
+		free(buffer);
+		errno = saved_errno;
 	}
+	if (!r.stopped)
+		read_block(NULL, 0);
 
 	// Close the file
-	if (file != stdin)
-		fclose(file);
+	if (fd != 0)
+		close(fd);
+	return r.stopped == -1 ? -1 : 0;
+}
+
+// Waits for changes of file name in directory watched by inotify_fd,
+// but no longer than FOLLOW_POLL_INTERVAL_MS
+static void wait_for_change(int inotify_fd, const char *name)
+{
+#ifdef __linux__
+	struct pollfd pfd;
+	char events[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t size;
+	ssize_t offset;
+	struct timespec now;
+	struct timespec deadline;
+	long timeout;
+
+	if (inotify_fd != -1) {
+		pfd.fd = inotify_fd;
+		pfd.events = POLLIN;
+
+		// events for other files do not restart the interval
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += FOLLOW_POLL_INTERVAL_MS / 1000;
+		deadline.tv_nsec += (FOLLOW_POLL_INTERVAL_MS % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		while (1) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout = (deadline.tv_sec - now.tv_sec) * 1000L +
+				(deadline.tv_nsec - now.tv_nsec) / 1000000L;
+			if (timeout <= 0 || poll(&pfd, 1, (int) timeout) <= 0)
+				return;
+
+			size = read(inotify_fd, events, sizeof(events));
+			if (size <= 0)
+				return;
+			for (offset = 0; offset < size;
+				offset += sizeof(*event) + event->len)
+			{
+				event = (const struct inotify_event *) (events + offset);
+				if (event->len == 0 || !strcmp(event->name, name))
+					return;
+			}
+		}
+	}
+#endif
+
+	(void) inotify_fd;
+	(void) name;
+	poll(NULL, 0, FOLLOW_POLL_INTERVAL_MS);
+}
+
+int file_follow(
+	int (*read_block)(const char *, size_t), const char *filename)
+{
+	char *buffer;
+	int fd = open_file(filename);
+	int inotify_fd = -1;
+	int ret = 0;
+	int saved_errno;
+	const char *name;
+	struct stat st;
+	struct stat path_st;
+
+	if (fd == -1)
+		return -1;
+
+	// stdin cannot be reopened, it is read to the end
+	buffer = xrealloc(NULL, READ_BLOCK_SIZE);
+	if (fd == 0) {
+		ret = read_available(read_block, fd, buffer);
+		if (ret == 0)
+			read_block(NULL, 0);
+		saved_errno = errno;
+		free(buffer);
+		errno = saved_errno;
+		return ret == -1 ? -1 : 0;
+	}
+
+	// Directory is watched, so that new file is noticed
+	// after rotation. Events for other files are skipped.
+	name = strrchr(filename, '/');
+	name = (name ? name + 1 : filename);
+#ifdef __linux__
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd != -1) {
+		char *dir = strdup(filename);
+		if (!dir) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		if (name == filename)
+			strcpy(dir, ".");
+		else if (name == filename + 1)
+			strcpy(dir, "/");
+		else
+			dir[name - filename - 1] = '\0';
+
+		if (inotify_add_watch(inotify_fd, dir,
+			IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) == -1)
+		{
+			close(inotify_fd);
+			inotify_fd = -1;
+		}
+		free(dir);
+	}
+#endif
+
+	while (1) {
+		if (fd != -1 && (ret = read_available(read_block, fd, buffer)) != 0)
+			break;
+
+		wait_for_change(inotify_fd, name);
+
+		if (fd != -1) {
+			if (fstat(fd, &st) == -1) {
+				ret = -1;
+				break;
+			}
+
+			// truncated
+			if (st.st_size < lseek(fd, 0, SEEK_CUR)) {
+				if (read_block(NULL, 0))
+					break;
+				lseek(fd, 0, SEEK_SET);
+				continue;
+			}
+		}
+
+		// replaced, the rest of old file is read before new one.
+		// File may be missing for a while during rotation.
+		if (stat(filename, &path_st) == -1)
+			continue;
+		if (fd != -1 && st.st_dev == path_st.st_dev && st.st_ino == path_st.st_ino)
+			continue;
+		if (fd != -1) {
+			if ((ret = read_available(read_block, fd, buffer)) != 0 ||
+				read_block(NULL, 0))
+			{
+				break;
+			}
+			close(fd);
+		}
+		fd = open(filename, O_RDONLY);
+	}
+
+	saved_errno = errno;
+	if (fd != -1)
+		close(fd);
+	if (inotify_fd != -1)
+		close(inotify_fd);
+	free(buffer);
+	errno = saved_errno;
+	return ret == -1 ? -1 : 0;
+}
+
+int file_buffer_open(struct file_buffer *fb, const char *filename)
+{
+	int fd = open_file(filename);
+	size_t allocated = READ_BLOCK_SIZE;
+	ssize_t nread;
+	int saved_errno;
+
+	fb->data = NULL;
+	fb->size = 0;
+	fb->mapped = 0;
+	if (fd == -1)
+		return -1;
+
+	if (map_fd(fd, &fb->data, &fb->size)) {
+		fb->mapped = 1;
+	} else {
+		// read the whole stream into memory
+		fb->mapped = 0;
+		fb->size = 0;
+		fb->data = xrealloc(NULL, allocated);
+		while ((nread = read(fd, fb->data + fb->size, allocated - fb->size)) != 0) {
+			if (nread == -1) {
+				if (errno == EINTR)
+					continue;
+				saved_errno = errno;
+				file_buffer_close(fb);
+				if (fd != 0)
+					close(fd);
+				errno = saved_errno;
+				return -1;
+			}
+
+			fb->size += nread;
+			if (fb->size == allocated) {
+				allocated *= 2;
+				fb->data = xrealloc(fb->data, allocated);
+			}
+		}
+	}
+
+	if (fd != 0)
+		close(fd);
+	return 0;
+}
+
+void file_buffer_close(struct file_buffer *fb)
+{
+	if (fb->mapped) {
+		if (fb->size > 0)
+			munmap(fb->data, fb->size);
+	} else {
+		free(fb->data);
+	}
+
+	fb->data = NULL;
+	fb->size = 0;
 }
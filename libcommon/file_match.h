@@ -24,12 +24,57 @@
 #ifndef _FILE_MATCH_H_
 #define _FILE_MATCH_H_
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void file_match(void (*match)(const char *), const char *filename);
-void file_match2(void (*match)(const char *, size_t), const char *filename);
+// Unlike file_match, lines passed to match() are not NUL-terminated.
+// Regular files are mmap(2)-ed, other inputs are read by large blocks.
+// Returns -1 and sets errno if file cannot be opened or read.
+int file_match2(void (*match)(const char *, size_t), const char *filename);
+
+#define FILE_MATCH_BATCH_SIZE 16
+
+// The same as file_match2 but up to FILE_MATCH_BATCH_SIZE lines
+// are passed to match_batch() at once.
+int file_match2_batch(
+	void (*match_batch)(const char **, const size_t *, size_t),
+	const char *filename);
+
+// Passes input to read_block() by blocks as they are read. Blocks of
+// streams (pipes, stdin etc.) are not aligned to lines, so unfinished
+// line is neither copied nor moved, see globmatch::feed(). Mapped
+// regular files are passed by blocks of complete lines.
+// read_block(NULL, 0) is called at the end of input. The rest of
+// input is not read if read_block() returns non-zero.
+// Returns -1 and sets errno if file cannot be opened or read.
+int file_read_blocks_until(
+	int (*read_block)(const char *, size_t), const char *filename);
+
+// Reads input as it grows like tail -f and passes new data to
+// read_block() by blocks that are not aligned to lines. Truncated file
+// is read again from the beginning, replaced one (e.g., rotated log)
+// is reopened and read from the beginning. read_block(NULL, 0) is
+// called before that and at the end of stdin, the unfinished line
+// is complete then. Returns 0 at the end of stdin or if read_block()
+// returns non-zero, -1 and sets errno if file cannot be opened or read.
+int file_follow(
+	int (*read_block)(const char *, size_t), const char *filename);
+
+// The whole input in memory: mmap-ed regular file or
+// stream (pipe, stdin etc.) read to the end.
+struct file_buffer {
+	char *data;
+	size_t size;
+	int mapped;
+};
+
+// Returns -1 and sets errno if file cannot be opened or read
+int file_buffer_open(struct file_buffer *fb, const char *filename);
+void file_buffer_close(struct file_buffer *fb);
 
 #ifdef __cplusplus
 }
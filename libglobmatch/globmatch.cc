@@ -0,0 +1,3669 @@
+/*
+ * Copyright (c) 2024 Aleksey Cheusov <vle@gmx.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Algorithm:
+// * Convert glob pattern to NFA.
+// * Map input weights of NFA (ASCII characters) to positive numbers,
+//   unseen character in this map is mapped to 0.
+// * Convert NFA to MinDFA using powerset construction and Hopcroft
+//   algorithm or Brzozoeski algorithm.
+// * Match using MinDFA.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cctype>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <vector>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <iostream>
+#include <utility>
+#include <string>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <numeric>
+#include <new>
+#include <bitset>
+
+#include "globmatch.h"
+
+
+static std::ostream &debug = std::cerr;
+
+struct iw_to {
+	unsigned iw = 0; // input weight
+	unsigned to = 0; // destination state
+
+	iw_to () {}
+	iw_to (unsigned iw, unsigned to) {
+		this->iw = iw;
+		this->to = to;
+	}
+};
+
+typedef std::vector<unsigned> vector_uint;
+typedef std::vector<iw_to> vector_iwto;
+typedef std::set<unsigned> set_uint;
+
+enum fsa_operation {
+	UNION,
+	INTERSECT,
+	SUBTRACT,
+	NEGATE,
+};
+
+// Decides whether DFA state is finite by flags "finite state of
+// original FSA number N is in the set" for all original FSAs
+typedef std::function<bool (const std::vector<bool> &)> accept_func;
+
+enum minimization_algorithm {
+	BRZOZOWSKI,
+	HOPCROFT,
+};
+
+static uint32_t nextpow2(uint32_t value)
+{
+	uint32_t ret = value;
+	ret |= ret >> 1;
+	ret |= ret >> 2;
+	ret |= ret >> 4;
+	ret |= ret >> 16;
+	return ret + 1;
+}
+
+// Hash of sorted set of states
+struct vector_uint_hash {
+	size_t operator() (const vector_uint &v) const noexcept
+	{
+		// FNV-1a
+		uint64_t h = 14695981039346656037ULL;
+		for (unsigned state: v) {
+			h ^= state;
+			h *= 1099511628211ULL;
+		}
+		return (size_t) h;
+	}
+};
+
+// Interns sets of NFA states. Sets are sorted vectors.
+class state_set2id {
+private:
+	std::unordered_map<vector_uint, unsigned, vector_uint_hash> m_map;
+	std::vector<const vector_uint *> m_sets;
+
+public:
+	state_set2id() {}
+
+	// Returns id of inserted item, i.e., 0, 1, 2, etc.
+	unsigned add(vector_uint &&v) {
+		auto ins = m_map.emplace(std::move(v), (unsigned) m_sets.size());
+		if (ins.second)
+			m_sets.push_back(&ins.first->first);
+		return ins.first->second;
+	}
+
+	const vector_uint& get(unsigned id) const {
+		return *m_sets[id];
+	}
+
+	unsigned size() const {
+		return (unsigned) m_sets.size();
+	}
+
+	void clear() {
+		m_map.clear();
+		m_sets.clear();
+	}
+};
+
+// Finite State Automaton used for building NFA and DFA.
+// It is slow but it does not matter for this test ;-)
+class fsa {
+private:
+	unsigned m_state_count = 0;
+	set_uint m_initial_states;
+	set_uint m_finite_states;
+	set_uint m_iws;
+	std::vector<vector_iwto> m_outgoing_arcs;
+	// sorted IDs of patterns matched in finite states
+	std::map<unsigned, vector_uint> m_pattern_ids;
+
+	static const vector_iwto m_empty_iwto;
+	static const vector_uint m_empty_ids;
+
+public:
+	fsa() {}
+
+	~fsa() {
+		clear();
+	}
+
+	void clear()
+	{
+		m_state_count = 0;
+		m_initial_states.clear();
+		m_finite_states.clear();
+		m_iws.clear();
+		m_outgoing_arcs.clear();
+		m_pattern_ids.clear();
+	}
+
+	inline unsigned get_state_count() const {
+		return m_state_count;
+	}
+
+	inline const set_uint& get_initial_states() const {
+		return m_initial_states;
+	}
+
+	inline const set_uint& get_finite_states() const {
+		return m_finite_states;
+	}
+
+	inline const set_uint& get_iws() const {
+		return m_iws;
+	}
+
+	inline const vector_iwto& get_arcs(unsigned state) const {
+		if (state < get_state_count())
+			return m_outgoing_arcs[state];
+		else
+			return m_empty_iwto;
+	}
+
+	inline bool has_pattern_ids() const {
+		return !m_pattern_ids.empty();
+	}
+
+	const vector_uint& get_pattern_ids(unsigned state) const {
+		auto found = m_pattern_ids.find(state);
+		if (found == m_pattern_ids.end())
+			return m_empty_ids;
+		return found->second;
+	}
+
+	vector_uint get_arcs(unsigned state, unsigned iw) const {
+		vector_uint ret;
+		const vector_iwto& outgoing_arcs = m_outgoing_arcs[state];
+		for (unsigned i = 0; i < outgoing_arcs.size(); ++i) {
+			const iw_to& arc = outgoing_arcs[i];
+			if (arc.iw == iw)
+				ret.push_back(arc.to);
+		}
+		return ret;
+	}
+
+public:
+	void add_finite_state(unsigned state) {
+		update_state_count(state);
+		m_finite_states.insert(state);
+	}
+
+	// ids should be sorted
+	void set_pattern_ids(unsigned state, const vector_uint& ids) {
+		add_finite_state(state);
+		m_pattern_ids[state] = ids;
+	}
+
+	void add_initial_state(unsigned state) {
+		update_state_count(state);
+		m_initial_states.insert(state);
+	}
+
+	void add_iw(unsigned iw) {
+		m_iws.insert(iw);
+	}
+
+	void add_arc(unsigned from, unsigned iw, unsigned to) {
+		update_state_count(from);
+		update_state_count(to);
+		add_iw(iw);
+
+		vector_iwto &outgoing_arcs = m_outgoing_arcs[from];
+		for (unsigned i = 0; i < outgoing_arcs.size(); ++i) {
+			iw_to &arc = outgoing_arcs[i];
+			if (arc.iw == iw && arc.to == to)
+				return;
+		}
+		outgoing_arcs.push_back(iw_to(iw, to));
+	}
+
+	bool is_finite_state(unsigned state) const {
+		return m_finite_states.find(state) != m_finite_states.end();
+	}
+
+private:
+	void update_state_count(unsigned state){
+		if (state < m_state_count)
+			return;
+
+		m_state_count = state + 1;
+		while (m_outgoing_arcs.size() < m_state_count) {
+			m_outgoing_arcs.resize(m_outgoing_arcs.size() + 1);
+		}
+	}
+};
+
+const vector_iwto fsa::m_empty_iwto;
+const vector_uint fsa::m_empty_ids;
+
+// In order to reduce memory consumption for storing matrix of arcs,
+// we map bytes to equivalence classes 0, 1, 2 etc. Bytes are equivalent
+// if they label the same arcs of src_fsa, e.g., all bytes of [a-z]
+// seen nowhere else. Class 0 contains bytes not seen in glob patterns
+// (input weight 0 of src_fsa).
+// If ignore_case is true, upper case ASCII letters are mapped to the
+// class of lower case ones, src_fsa should not mention them.
+// Returned value is an allocated and filled IW map array.
+static unsigned *build_iwmap(
+	fsa& dst_fsa, unsigned iw_map_size, const fsa& src_fsa,
+	bool ignore_case = false)
+{
+	// build iw_map
+	const set_uint& iws = src_fsa.get_iws();
+
+	unsigned iw_count = 0;
+	for (unsigned iw: iws) {
+		if (iw >= iw_count)
+			iw_count = iw + 1;
+	}
+	assert(iw_count <= iw_map_size);
+
+	// arcs labeled by every input weight
+	typedef std::vector<std::pair<unsigned, unsigned>> arc_list;
+	std::vector<arc_list> iw_arcs(iw_map_size);
+	for (unsigned from = 0; from < src_fsa.get_state_count(); ++from) {
+		for (const iw_to &arc: src_fsa.get_arcs(from))
+			iw_arcs[arc.iw].push_back(std::make_pair(from, arc.to));
+	}
+	for (arc_list &arcs: iw_arcs)
+		std::sort(arcs.begin(), arcs.end());
+
+	unsigned *iw_map = new unsigned[iw_map_size];
+	std::map<arc_list, unsigned> classes;
+	classes[iw_arcs[0]] = 0;
+	for (unsigned iw = 0; iw < iw_map_size; ++iw) {
+		const arc_list &arcs = (iws.count(iw) ? iw_arcs[iw] : iw_arcs[0]);
+		auto found = classes.insert(std::make_pair(arcs, classes.size()));
+		iw_map[iw] = found.first->second;
+	}
+	if (ignore_case) {
+		for (unsigned iw = 'A'; iw <= 'Z'; ++iw)
+			iw_map[iw] = iw_map[iw - 'A' + 'a'];
+	}
+
+	// build dst_fsa
+	const set_uint& initial_states = src_fsa.get_initial_states();
+	for (unsigned state: initial_states)
+		dst_fsa.add_initial_state(state);
+
+	const set_uint& finite_states = src_fsa.get_finite_states();
+	for (unsigned state: finite_states)
+		dst_fsa.add_finite_state(state);
+	if (src_fsa.has_pattern_ids()) {
+		for (unsigned state: finite_states)
+			dst_fsa.set_pattern_ids(state, src_fsa.get_pattern_ids(state));
+	}
+
+	for (unsigned from = 0; from < src_fsa.get_state_count(); ++from) {
+		const vector_iwto& outgoing_arcs = src_fsa.get_arcs(from);
+		for (unsigned i = 0; i < outgoing_arcs.size(); ++i) {
+			unsigned iw = outgoing_arcs[i].iw;
+			unsigned to = outgoing_arcs[i].to;
+			dst_fsa.add_arc(from, iw_map[iw], to);
+		}
+	}
+
+	return iw_map;
+}
+
+// Inverts FSA, that is, inverts all arcs, make initial states finite and vice versa.
+static void invert(fsa& dst_fsa, const fsa& src_fsa)
+{
+	dst_fsa.clear();
+
+	for (unsigned iw: src_fsa.get_iws())
+		dst_fsa.add_iw(iw);
+
+	for (unsigned state: src_fsa.get_initial_states())
+		dst_fsa.add_finite_state(state);
+
+	for (unsigned state: src_fsa.get_finite_states())
+		dst_fsa.add_initial_state(state);
+
+	std::size_t state_count = src_fsa.get_state_count();
+	for (unsigned from = 0; from < state_count; ++from) {
+		for (const iw_to& iwto: src_fsa.get_arcs(from)) {
+			unsigned iw = iwto.iw;
+			unsigned to = iwto.to;
+			dst_fsa.add_arc(to, iw, from);
+		}
+	}
+}
+
+// Convert Non-deterministic FSA to Deterministic FSA
+// https://en.m.wikipedia.org/wiki/Powerset_construction
+// DFA states are sorted vectors of NFA states interned by hash table.
+// Outgoing arcs of every NFA state are precomputed and grouped
+// by input weight, so successors of DFA state are collected
+// by one pass over its NFA states.
+// NFA is a union of original_fsa_count FSAs, finite states
+// of FSAs are listed in finite_state2fsa_num, is_finite decides
+// which DFA states are finite (product construction).
+// If the empty set of NFA states is finite (complement),
+// it is added to DFA explicitly and DFA is made complete.
+static void nfa2dfa(
+	fsa& dfa,
+	const fsa &nfa,
+	const std::map<unsigned, unsigned> &finite_state2fsa_num,
+	unsigned original_fsa_count,
+	const accept_func &is_finite)
+{
+	dfa.clear();
+
+	for (unsigned iw: nfa.get_iws())
+		dfa.add_iw(iw);
+
+	const set_uint &initial_states = nfa.get_initial_states();
+	if (initial_states.empty())
+		return;
+
+	bool complete = is_finite(std::vector<bool>(original_fsa_count));
+	if (complete)
+		dfa.add_iw(0); // bytes unseen in patterns
+
+	// dense numbers of input weights
+	const set_uint& iws = dfa.get_iws();
+	std::vector<unsigned> iw_list(iws.begin(), iws.end());
+	std::vector<unsigned> iw2idx(iw_list.empty() ? 0 : iw_list.back() + 1);
+	for (unsigned i = 0; i < iw_list.size(); ++i)
+		iw2idx[iw_list[i]] = i;
+
+	// finite NFA states and numbers of original FSA they belong to
+	unsigned state_count = nfa.get_state_count();
+	std::vector<int> fsa_num(state_count, -1);
+	for (unsigned state: nfa.get_finite_states()) {
+		auto found = finite_state2fsa_num.find(state);
+		fsa_num[state] = (found == finite_state2fsa_num.end() ? 0 : found->second);
+	}
+
+	// successors of NFA states sorted by input weight index
+	std::vector<std::vector<std::pair<unsigned, unsigned>>> succ(state_count);
+	for (unsigned state = 0; state < state_count; ++state) {
+		for (const iw_to& arc: nfa.get_arcs(state))
+			succ[state].push_back(std::make_pair(iw2idx[arc.iw], arc.to));
+		std::sort(succ[state].begin(), succ[state].end());
+	}
+
+	state_set2id set2id;
+	set2id.add(vector_uint(initial_states.begin(), initial_states.end()));
+	dfa.add_initial_state(0);
+
+	std::vector<vector_uint> to_sets(iw_list.size());
+	std::vector<unsigned> used_iws;
+	std::vector<bool> fsa_seen(original_fsa_count);
+	vector_uint ids;
+
+	// DFA states are numbered in order of discovery
+	for (unsigned dfa_from = 0; dfa_from < set2id.size(); ++dfa_from) {
+		const vector_uint &from_set = set2id.get(dfa_from);
+
+		std::fill(fsa_seen.begin(), fsa_seen.end(), false);
+		for (unsigned from_state: from_set) {
+			int num = fsa_num[from_state];
+			if (num >= 0)
+				fsa_seen[num] = true;
+		}
+
+		if (is_finite(fsa_seen))
+			dfa.add_finite_state(dfa_from);
+
+		// finite DFA state matches patterns of all its NFA states
+		if (nfa.has_pattern_ids() && dfa.is_finite_state(dfa_from)) {
+			ids.clear();
+			for (unsigned from_state: from_set) {
+				const vector_uint &state_ids = nfa.get_pattern_ids(from_state);
+				ids.insert(ids.end(), state_ids.begin(), state_ids.end());
+			}
+			std::sort(ids.begin(), ids.end());
+			ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+			dfa.set_pattern_ids(dfa_from, ids);
+		}
+
+		// group successors by input weight
+		used_iws.clear();
+		for (unsigned from_state: from_set) {
+			for (const std::pair<unsigned, unsigned> &arc: succ[from_state]) {
+				vector_uint &to_set = to_sets[arc.first];
+				if (to_set.empty())
+					used_iws.push_back(arc.first);
+				to_set.push_back(arc.second);
+			}
+		}
+		if (complete && used_iws.size() < iw_list.size()) {
+			// missing arcs lead to the empty set
+			for (unsigned iw_idx = 0; iw_idx < iw_list.size(); ++iw_idx) {
+				if (to_sets[iw_idx].empty()) {
+					dfa.add_arc(dfa_from, iw_list[iw_idx], set2id.add(vector_uint()));
+				}
+			}
+		}
+		std::sort(used_iws.begin(), used_iws.end());
+
+		for (unsigned iw_idx: used_iws) {
+			vector_uint to_set;
+			to_set.swap(to_sets[iw_idx]);
+			std::sort(to_set.begin(), to_set.end());
+			to_set.erase(std::unique(to_set.begin(), to_set.end()), to_set.end());
+
+			unsigned dfa_to = set2id.add(std::move(to_set));
+			dfa.add_arc(dfa_from, iw_list[iw_idx], dfa_to);
+		}
+	}
+}
+
+// Predicate for operation applied to all original FSAs
+static accept_func operation_accept(fsa_operation operation)
+{
+	accept_func is_finite;
+	switch (operation) {
+		case UNION:
+			is_finite = [](const std::vector<bool> &seen) {
+				return std::find(seen.begin(), seen.end(), true) != seen.end();
+			};
+			break;
+
+		case INTERSECT:
+			is_finite = [](const std::vector<bool> &seen) {
+				return std::find(seen.begin(), seen.end(), false) == seen.end();
+			};
+			break;
+
+		case SUBTRACT:
+			is_finite = [](const std::vector<bool> &seen) {
+				return seen[0] &&
+					std::find(seen.begin() + 1, seen.end(), true) == seen.end();
+			};
+			break;
+
+		case NEGATE:
+			is_finite = [](const std::vector<bool> &seen) {
+				return std::find(seen.begin(), seen.end(), true) == seen.end();
+			};
+			break;
+
+		default:
+			abort();
+	}
+
+	return is_finite;
+}
+
+// The same as above for operation applied to all original FSAs
+static void nfa2dfa(
+	fsa& dfa,
+	const fsa &nfa,
+	const std::map<unsigned, unsigned> &finite_state2fsa_num,
+	fsa_operation operation)
+{
+	unsigned original_fsa_count = 0;
+	for (std::pair<unsigned, unsigned> p: finite_state2fsa_num) {
+		if (p.second > original_fsa_count)
+			original_fsa_count = p.second;
+	}
+	++original_fsa_count;
+	//debug << "original_fsa_count:" << original_fsa_count << '\n';
+
+	nfa2dfa(dfa, nfa, finite_state2fsa_num, original_fsa_count,
+		operation_accept(operation));
+}
+
+static void nfa2dfa(fsa& dfa, const fsa &nfa)
+{
+	std::map<unsigned, unsigned> empty;
+	nfa2dfa(dfa, nfa, empty, UNION);
+}
+
+// Partition of states 0..N-1 into blocks used by Hopcroft algorithm.
+// States of every block are contiguous in m_elems, marked states
+// are moved to the beginning of their block.
+class state_partition {
+private:
+	std::vector<unsigned> m_elems;
+	std::vector<unsigned> m_loc;   // position of state in m_elems
+	std::vector<unsigned> m_block; // block of state
+	std::vector<unsigned> m_first; // [first, past) range of block
+	std::vector<unsigned> m_past;
+	std::vector<unsigned> m_mid;   // end of marked states of block
+	std::vector<unsigned> m_touched;
+
+public:
+	// states with equal labels are put to the same initial block
+	state_partition(const std::vector<unsigned> &labels)
+	{
+		unsigned state_count = labels.size();
+		m_elems.resize(state_count);
+		m_loc.resize(state_count);
+		m_block.resize(state_count);
+
+		std::vector<unsigned> order(state_count);
+		for (unsigned i = 0; i < state_count; ++i)
+			order[i] = i;
+		std::stable_sort(order.begin(), order.end(),
+			[&labels](unsigned a, unsigned b) { return labels[a] < labels[b]; });
+
+		for (unsigned i = 0; i < state_count; ++i) {
+			unsigned state = order[i];
+			if (i == 0 || labels[state] != labels[order[i - 1]]) {
+				if (i > 0)
+					m_past.push_back(i);
+				m_first.push_back(i);
+				m_mid.push_back(i);
+			}
+			m_elems[i] = state;
+			m_loc[state] = i;
+			m_block[state] = m_first.size() - 1;
+		}
+		if (state_count > 0)
+			m_past.push_back(state_count);
+	}
+
+	unsigned get_block_count() const {
+		return m_first.size();
+	}
+
+	unsigned get_block(unsigned state) const {
+		return m_block[state];
+	}
+
+	unsigned get_size(unsigned block) const {
+		return m_past[block] - m_first[block];
+	}
+
+	unsigned get_state(unsigned block, unsigned idx) const {
+		return m_elems[m_first[block] + idx];
+	}
+
+	void mark(unsigned state)
+	{
+		unsigned block = m_block[state];
+		unsigned pos = m_loc[state];
+		unsigned mid = m_mid[block];
+		if (pos < mid)
+			return;
+
+		if (mid == m_first[block])
+			m_touched.push_back(block);
+
+		std::swap(m_elems[pos], m_elems[mid]);
+		m_loc[m_elems[pos]] = pos;
+		m_loc[m_elems[mid]] = mid;
+		++m_mid[block];
+	}
+
+	// Splits touched blocks into marked and unmarked parts.
+	// New blocks consist of marked states, for every split
+	// pair (old block, new block) is added to splits.
+	void split(std::vector<std::pair<unsigned, unsigned>> &splits)
+	{
+		splits.clear();
+		for (unsigned block: m_touched) {
+			if (m_mid[block] == m_past[block]) {
+				m_mid[block] = m_first[block];
+				continue;
+			}
+
+			unsigned new_block = m_first.size();
+			m_first.push_back(m_first[block]);
+			m_past.push_back(m_mid[block]);
+			m_mid.push_back(m_first[block]);
+			for (unsigned i = m_first[new_block]; i < m_past[new_block]; ++i)
+				m_block[m_elems[i]] = new_block;
+
+			m_first[block] = m_mid[block];
+			splits.push_back(std::make_pair(block, new_block));
+		}
+		m_touched.clear();
+	}
+};
+
+// Minimize DFA with the help of Hopcroft algorithm.
+// Missing arcs lead to implicit dead state, states equivalent to it
+// are removed. States of minimal DFA are numbered in BFS order.
+// https://en.wikipedia.org/wiki/DFA_minimization
+static void minimize_dfa(fsa& mindfa, const fsa& dfa)
+{
+	mindfa.clear();
+
+	for (unsigned iw: dfa.get_iws())
+		mindfa.add_iw(iw);
+
+	if (dfa.get_initial_states().empty())
+		return;
+
+	std::vector<unsigned> iw_list(dfa.get_iws().begin(), dfa.get_iws().end());
+	unsigned iw_count = iw_list.size();
+	std::vector<unsigned> iw2idx(iw_list.empty() ? 0 : iw_list.back() + 1);
+	for (unsigned i = 0; i < iw_count; ++i)
+		iw2idx[iw_list[i]] = i;
+
+	// complete DFA with dead state
+	unsigned dead = dfa.get_state_count();
+	unsigned state_count = dead + 1;
+	std::vector<unsigned> delta(state_count * iw_count, dead);
+	for (unsigned from = 0; from < dead; ++from) {
+		for (const iw_to& arc: dfa.get_arcs(from))
+			delta[from * iw_count + iw2idx[arc.iw]] = arc.to;
+	}
+
+	// inverted arcs grouped by (to, iw)
+	std::vector<unsigned> inv_first(state_count * iw_count + 1, 0);
+	std::vector<unsigned> inv_from(state_count * iw_count);
+	for (unsigned i = 0; i < delta.size(); ++i)
+		++inv_first[delta[i] * iw_count + i % iw_count + 1];
+	for (unsigned i = 1; i < inv_first.size(); ++i)
+		inv_first[i] += inv_first[i - 1];
+	std::vector<unsigned> inv_pos(inv_first.begin(), inv_first.end() - 1);
+	for (unsigned i = 0; i < delta.size(); ++i)
+		inv_from[inv_pos[delta[i] * iw_count + i % iw_count]++] = i / iw_count;
+
+	// initial partition: non-finite states and finite states
+	// grouped by sets of matched patterns
+	std::vector<unsigned> labels(state_count);
+	std::map<vector_uint, unsigned> ids2label;
+	for (unsigned state = 0; state < dead; ++state) {
+		if (!dfa.is_finite_state(state))
+			continue;
+
+		const vector_uint &ids = dfa.get_pattern_ids(state);
+		auto found = ids2label.insert(std::make_pair(ids, ids2label.size() + 1));
+		labels[state] = found.first->second;
+	}
+
+	state_partition partition(labels);
+
+	// splitters (block, iw)
+	std::vector<std::pair<unsigned, unsigned>> waiting;
+	std::vector<bool> is_waiting;
+	for (unsigned block = 0; block < partition.get_block_count(); ++block) {
+		for (unsigned iw_idx = 0; iw_idx < iw_count; ++iw_idx) {
+			waiting.push_back(std::make_pair(block, iw_idx));
+			is_waiting.push_back(true);
+		}
+	}
+
+	vector_uint splitter;
+	std::vector<std::pair<unsigned, unsigned>> splits;
+	while (!waiting.empty()) {
+		unsigned block = waiting.back().first;
+		unsigned iw_idx = waiting.back().second;
+		waiting.pop_back();
+		is_waiting[block * iw_count + iw_idx] = false;
+
+		// marking reorders states inside blocks
+		splitter.clear();
+		for (unsigned i = 0; i < partition.get_size(block); ++i)
+			splitter.push_back(partition.get_state(block, i));
+
+		for (unsigned to: splitter) {
+			unsigned idx = to * iw_count + iw_idx;
+			for (unsigned i = inv_first[idx]; i < inv_first[idx + 1]; ++i)
+				partition.mark(inv_from[i]);
+		}
+
+		partition.split(splits);
+		is_waiting.resize(partition.get_block_count() * iw_count, false);
+		for (std::pair<unsigned, unsigned> p: splits) {
+			unsigned old_block = p.first;
+			unsigned new_block = p.second;
+			bool new_smaller = partition.get_size(new_block) <= partition.get_size(old_block);
+			for (unsigned i = 0; i < iw_count; ++i) {
+				unsigned add = new_block;
+				if (!is_waiting[old_block * iw_count + i] && !new_smaller)
+					add = old_block;
+
+				waiting.push_back(std::make_pair(add, i));
+				is_waiting[add * iw_count + i] = true;
+			}
+		}
+	}
+
+	// build minimal DFA
+	unsigned dead_block = partition.get_block(dead);
+	std::vector<unsigned> block2state(partition.get_block_count(), (unsigned)-1);
+	std::vector<unsigned> queue;
+
+	unsigned initial_block = partition.get_block(*dfa.get_initial_states().begin());
+	if (initial_block == dead_block)
+		return;
+
+	block2state[initial_block] = 0;
+	queue.push_back(initial_block);
+	mindfa.add_initial_state(0);
+
+	for (unsigned i = 0; i < queue.size(); ++i) {
+		unsigned block = queue[i];
+		unsigned from = partition.get_state(block, 0);
+		if (dfa.is_finite_state(from))
+			mindfa.add_finite_state(i);
+		if (dfa.has_pattern_ids() && dfa.is_finite_state(from))
+			mindfa.set_pattern_ids(i, dfa.get_pattern_ids(from));
+
+		for (unsigned iw_idx = 0; iw_idx < iw_count; ++iw_idx) {
+			unsigned to_block = partition.get_block(delta[from * iw_count + iw_idx]);
+			if (to_block == dead_block)
+				continue;
+
+			if (block2state[to_block] == (unsigned)-1) {
+				block2state[to_block] = queue.size();
+				queue.push_back(to_block);
+			}
+			mindfa.add_arc(i, iw_list[iw_idx], block2state[to_block]);
+		}
+	}
+}
+
+// Convert Non-deterministic FSA to Minimal Deterministic FSA
+// with the help of Brzozowski algorithm or
+// powerset construction followed by Hopcroft algorithm.
+// https://en.wikipedia.org/wiki/DFA_minimization
+static void nfa2mindfa(
+	fsa& dfa, const fsa &nfa,
+	minimization_algorithm algorithm = HOPCROFT)
+{
+	if (algorithm == HOPCROFT) {
+		fsa tmp_dfa;
+		nfa2dfa(tmp_dfa, nfa);
+		minimize_dfa(dfa, tmp_dfa);
+	} else {
+		fsa inv;
+		invert(inv, nfa);
+
+		fsa tmp_dfa;
+		nfa2dfa(tmp_dfa, inv);
+
+		inv.clear();
+		invert(inv, tmp_dfa);
+
+		nfa2dfa(dfa, inv);
+	}
+
+	// nothing is accepted, single non-finite state without arcs
+	if (dfa.get_initial_states().empty())
+		dfa.add_initial_state(0);
+}
+
+// Returns true if matching by DFA may stop before the end of input,
+// that is, DFA has missing arcs (for input weights iws) or
+// a finite state looping on every input.
+static bool dfa_stops_early(const fsa &dfa, const set_uint &iws)
+{
+	for (unsigned state = 0; state < dfa.get_state_count(); ++state) {
+		const vector_iwto &arcs = dfa.get_arcs(state);
+		if (arcs.size() < iws.size())
+			return true;
+		if (!dfa.is_finite_state(state))
+			continue;
+
+		bool loop = true;
+		for (const iw_to &arc: arcs)
+			loop = loop && (arc.to == state);
+		if (loop)
+			return true;
+	}
+	return false;
+}
+
+// Literals required by DFA, they are used for rejecting lines
+// and skipping blocks of input before running DFA.
+// Empty literal means "no such literal".
+struct required_literals {
+	std::string prefix; // every accepted line starts with it
+	std::string suffix; // every accepted line ends with it
+	std::string infix;  // every accepted line contains it
+};
+
+static const unsigned max_literal_length = 256;
+static const unsigned min_skip_literal_length = 2;
+// infix detection is quadratic, so it is skipped for huge DFAs
+static const unsigned max_infix_dfa_state_count = 4096;
+
+// Returns literal that every line accepted by DFA starts with.
+// iw2byte maps input weight to the only byte mapped to it or to -1.
+static std::string dfa_prefix(const fsa &dfa, const std::vector<int> &iw2byte)
+{
+	std::string ret;
+	if (dfa.get_initial_states().size() != 1)
+		return ret;
+
+	unsigned state = *dfa.get_initial_states().begin();
+	while (!dfa.is_finite_state(state) && ret.size() < max_literal_length) {
+		const vector_iwto& arcs = dfa.get_arcs(state);
+		if (arcs.size() != 1 || arcs[0].to == state || iw2byte[arcs[0].iw] < 0)
+			break;
+
+		ret += (char) iw2byte[arcs[0].iw];
+		state = arcs[0].to;
+	}
+
+	return ret;
+}
+
+// Returns literal that every path from initial state to one of
+// target states ends with. If skip_targets is true, arcs between
+// target states are ignored, that is, the literal precedes the first
+// entrance to target states. inv is inverted DFA.
+static std::string dfa_literal_before(
+	const fsa &dfa, const fsa &inv,
+	const std::vector<int> &iw2byte,
+	const set_uint &targets, bool skip_targets)
+{
+	std::string ret;
+	set_uint current = targets;
+	const set_uint &initial_states = dfa.get_initial_states();
+
+	while (ret.size() < max_literal_length) {
+		// path may start here, so nothing precedes it
+		for (unsigned state: initial_states)
+			if (current.count(state))
+				return std::string(ret.rbegin(), ret.rend());
+
+		int byte = -1;
+		set_uint prev;
+		for (unsigned state: current) {
+			for (const iw_to& arc: inv.get_arcs(state)) {
+				if (skip_targets && targets.count(arc.to))
+					continue;
+				if (iw2byte[arc.iw] < 0 || (byte >= 0 && iw2byte[arc.iw] != byte))
+					return std::string(ret.rbegin(), ret.rend());
+
+				byte = iw2byte[arc.iw];
+				prev.insert(arc.to);
+			}
+		}
+		if (prev.empty())
+			break;
+
+		ret += (char) byte;
+		current.swap(prev);
+		skip_targets = false;
+	}
+
+	return std::string(ret.rbegin(), ret.rend());
+}
+
+// Returns true if every path from initial state to finite one
+// goes through the state
+static bool is_dominator(const fsa &dfa, unsigned state)
+{
+	std::vector<bool> visited(dfa.get_state_count());
+	std::vector<unsigned> stack;
+	for (unsigned s: dfa.get_initial_states()) {
+		if (s == state)
+			return true;
+		visited[s] = true;
+		stack.push_back(s);
+	}
+
+	while (!stack.empty()) {
+		unsigned from = stack.back();
+		stack.pop_back();
+		if (dfa.is_finite_state(from))
+			return false;
+
+		for (const iw_to& arc: dfa.get_arcs(from)) {
+			if (arc.to != state && !visited[arc.to]) {
+				visited[arc.to] = true;
+				stack.push_back(arc.to);
+			}
+		}
+	}
+
+	return true;
+}
+
+// Extracts literals required by minimal DFA
+static void dfa_literals(
+	required_literals &literals,
+	const fsa &dfa, const std::vector<int> &iw2byte)
+{
+	literals = required_literals();
+
+	literals.prefix = dfa_prefix(dfa, iw2byte);
+
+	fsa inv;
+	invert(inv, dfa);
+
+	literals.suffix = dfa_literal_before(
+		dfa, inv, iw2byte, dfa.get_finite_states(), false);
+
+	if (dfa.get_state_count() > max_infix_dfa_state_count)
+		return;
+
+	// the longest literal preceding states every accepted line goes through
+	for (unsigned state = 0; state < dfa.get_state_count(); ++state) {
+		if (!is_dominator(dfa, state))
+			continue;
+
+		set_uint targets;
+		targets.insert(state);
+		std::string infix = dfa_literal_before(dfa, inv, iw2byte, targets, true);
+		if (infix.size() > literals.infix.size())
+			literals.infix = infix;
+	}
+}
+
+// copy NFAs to single NFA
+static void copy_nfas(
+	fsa& dst,
+	std::map<unsigned, unsigned>& finite_state2fsa_num,
+	const std::vector<fsa> &src)
+{
+	dst.clear();
+
+	set_uint common_iws;
+	for (const fsa& nfa: src) {
+		common_iws.insert(nfa.get_iws().begin(), nfa.get_iws().end());
+	}
+
+	for (unsigned iw: common_iws)
+		dst.add_iw(iw);
+
+	unsigned offset = 0;
+	for (size_t fsa_num = 0; fsa_num < src.size(); ++fsa_num) {
+		const fsa& nfa = src[fsa_num];
+
+		for (unsigned state: nfa.get_initial_states())
+			dst.add_initial_state(state + offset);
+
+		for (unsigned state: nfa.get_finite_states())
+			finite_state2fsa_num[state + offset] = fsa_num;
+
+		const set_uint& current_iws = nfa.get_iws();
+
+		set_uint iws_diff;
+		std::set_difference(
+			common_iws.begin(), common_iws.end(),
+			current_iws.begin(), current_iws.end(),
+			std::inserter(iws_diff, iws_diff.begin()));
+
+		size_t state_count = nfa.get_state_count();
+		for (unsigned state = 0; state < state_count; ++state) {
+			for (const iw_to& iwto: nfa.get_arcs(state)) {
+				unsigned iw = iwto.iw;
+				unsigned to = iwto.to;
+				if (iw) {
+					dst.add_arc(state + offset, iw, to + offset);
+				} else {
+					dst.add_arc(state + offset, 0, to + offset);
+					for (unsigned new_iw: iws_diff) {
+						dst.add_arc(state + offset, new_iw, to + offset);
+					}
+				}
+			}
+		}
+
+		offset = dst.get_state_count();
+	}
+}
+
+// Union of several NFA. If pattern_ids is true, finite states
+// remember numbers of NFA they come from.
+static void union_nfa(
+	fsa& dst,
+	const std::vector<fsa> &src,
+	bool pattern_ids = false)
+{
+	std::map<unsigned, unsigned> finite_state2fsa_num;
+	copy_nfas(dst, finite_state2fsa_num, src);
+	for (std::pair<unsigned, unsigned> p: finite_state2fsa_num) {
+		if (pattern_ids)
+			dst.set_pattern_ids(p.first, vector_uint(1, p.second));
+		else
+			dst.add_finite_state(p.first);
+	}
+}
+
+// Intersect of several NFA
+static void intersect_nfa(
+	fsa& dst,
+	const std::vector<fsa> &src)
+{
+	std::map<unsigned, unsigned> finite_state2fsa_num;
+	fsa tmp_nfa;
+	copy_nfas(tmp_nfa, finite_state2fsa_num, src);
+	for (std::pair<unsigned, unsigned> p: finite_state2fsa_num) {
+		tmp_nfa.add_finite_state(p.first);
+	}
+	nfa2dfa(dst, tmp_nfa, finite_state2fsa_num, INTERSECT);
+}
+
+// Subtract of several NFA
+static void subtract_nfa(
+	fsa& dst,
+	const std::vector<fsa> &src)
+{
+	std::map<unsigned, unsigned> finite_state2fsa_num;
+	fsa tmp_nfa;
+	copy_nfas(tmp_nfa, finite_state2fsa_num, src);
+	for (std::pair<unsigned, unsigned> p: finite_state2fsa_num) {
+		tmp_nfa.add_finite_state(p.first);
+	}
+	nfa2dfa(dst, tmp_nfa, finite_state2fsa_num, SUBTRACT);
+}
+
+// Returns the end of bracket expression like [a-z] starting at p
+// or nullptr if it is not terminated, then '[' is a literal
+static const char *glob_bracket_end(const char *p)
+{
+	++p;
+	if (*p == '!' || *p == '^')
+		++p;
+	// the first ']' is a literal
+	if (*p == ']')
+		++p;
+
+	while (*p && *p != ']') {
+		if (p[0] == '[' && p[1] == ':') {
+			const char *name_end = p + 2;
+			while (isalpha((unsigned char) *name_end))
+				++name_end;
+			if (name_end[0] == ':' && name_end[1] == ']') {
+				p = name_end + 2;
+				continue;
+			}
+		}
+		if (p[0] == '\\' && p[1])
+			++p;
+		++p;
+	}
+	return *p ? p + 1 : nullptr;
+}
+
+// Returns the end of glob token starting at p:
+// escaped byte, bracket expression or a single byte
+static const char *glob_token_end(const char *p)
+{
+	if (p[0] == '\\' && p[1])
+		return p + 2;
+	if (p[0] == '[') {
+		const char *end = glob_bracket_end(p);
+		if (end)
+			return end;
+	}
+	return p + 1;
+}
+
+// Boolean expression over glob patterns, e.g., (a* & *b) | !*tmp*
+// ! has the highest priority, then & and |.  Globs are terminated
+// by spaces and ()&|! characters.  Expression is stored in postfix
+// form, the same glob used twice is a single operand.
+class bool_expr {
+private:
+	enum op_type {
+		OP_GLOB,
+		OP_NOT,
+		OP_AND,
+		OP_OR,
+	};
+
+	struct op {
+		op_type type;
+		unsigned glob;
+	};
+
+	std::vector<op> m_program;
+	std::vector<std::string> m_globs;
+
+	const char *m_pos = nullptr;
+	std::string m_error;
+
+	void skip_spaces()
+	{
+		while (*m_pos == ' ' || *m_pos == '\t')
+			++m_pos;
+	}
+
+	static bool is_special(char c)
+	{
+		return !c || strchr(" \t()&|!", c);
+	}
+
+	void add_op(op_type type, unsigned glob = 0)
+	{
+		m_program.push_back(op{type, glob});
+	}
+
+	void error(const char *msg)
+	{
+		if (m_error.empty())
+			m_error = msg;
+	}
+
+	// or := and ('|' and)*
+	void parse_or()
+	{
+		parse_and();
+		while (m_error.empty() && *m_pos == '|') {
+			++m_pos;
+			parse_and();
+			add_op(OP_OR);
+		}
+	}
+
+	// and := not ('&' not)*
+	void parse_and()
+	{
+		parse_not();
+		while (m_error.empty() && *m_pos == '&') {
+			++m_pos;
+			parse_not();
+			add_op(OP_AND);
+		}
+	}
+
+	// not := '!' not | '(' or ')' | GLOB
+	void parse_not()
+	{
+		skip_spaces();
+		if (*m_pos == '!') {
+			++m_pos;
+			parse_not();
+			add_op(OP_NOT);
+		} else if (*m_pos == '(') {
+			++m_pos;
+			parse_or();
+			if (*m_pos != ')')
+				return error("')' expected");
+			++m_pos;
+		} else if (is_special(*m_pos)) {
+			return error("glob pattern expected");
+		} else {
+			const char *begin = m_pos;
+			while (!is_special(*m_pos))
+				m_pos = glob_token_end(m_pos);
+
+			std::string glob(begin, m_pos);
+			unsigned idx = std::find(m_globs.begin(), m_globs.end(), glob) - m_globs.begin();
+			if (idx == m_globs.size())
+				m_globs.push_back(glob);
+			add_op(OP_GLOB, idx);
+		}
+		skip_spaces();
+	}
+
+public:
+	// Returns false and sets error in case of syntax error
+	bool parse(const std::string &expr, std::string &error)
+	{
+		m_program.clear();
+		m_globs.clear();
+		m_error.clear();
+		m_pos = expr.c_str();
+
+		parse_or();
+		if (m_error.empty() && *m_pos)
+			this->error("unexpected character");
+
+		if (!m_error.empty()) {
+			error = m_error + " at position " + std::to_string(m_pos - expr.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	const std::vector<std::string> &get_globs() const {
+		return m_globs;
+	}
+
+	// glob_matched[i] is true if the i-th glob matches
+	bool eval(const std::vector<bool> &glob_matched) const
+	{
+		std::vector<char> stack(m_program.size() + 1);
+		unsigned top = 0;
+		for (const op &o: m_program) {
+			switch (o.type) {
+				case OP_GLOB:
+					stack[top++] = glob_matched[o.glob];
+					break;
+				case OP_NOT:
+					stack[top - 1] = !stack[top - 1];
+					break;
+				case OP_AND:
+					--top;
+					stack[top - 1] = stack[top - 1] && stack[top];
+					break;
+				case OP_OR:
+					--top;
+					stack[top - 1] = stack[top - 1] || stack[top];
+					break;
+			}
+		}
+		return stack[0];
+	}
+};
+
+// Boolean expression of several NFA, src[i] is NFA for
+// the i-th glob of expression
+static void expression_nfa(
+	fsa& dst,
+	const std::vector<fsa> &src,
+	const bool_expr &expr)
+{
+	std::map<unsigned, unsigned> finite_state2fsa_num;
+	fsa tmp_nfa;
+	copy_nfas(tmp_nfa, finite_state2fsa_num, src);
+	for (std::pair<unsigned, unsigned> p: finite_state2fsa_num) {
+		tmp_nfa.add_finite_state(p.first);
+	}
+	nfa2dfa(dst, tmp_nfa, finite_state2fsa_num, src.size(),
+		[&expr](const std::vector<bool> &seen) { return expr.eval(seen); });
+}
+
+// Functions for debugging
+static void print_vector(const set_uint &s)
+{
+	for (unsigned v: s) {
+		debug << ' ' << v;
+	}
+}
+
+static void print_fsa(fsa &_fsa)
+{
+	debug << "state count: " << _fsa.get_state_count() << '\n';
+
+	debug << "initial states:";
+	print_vector(_fsa.get_initial_states());
+	debug << '\n';
+
+	debug << "finite states:";
+	print_vector(_fsa.get_finite_states());
+	debug << '\n';
+
+	debug << "input weights:";
+	print_vector(_fsa.get_iws());
+	debug << '\n';
+
+//	debug << "finite states2:\n";
+//	for (unsigned i = 0; i < _fsa.get_state_count(); ++i) {
+//		debug << " state " << i << " is finite: " << _fsa.is_finite_state(i) << '\n';
+//	}
+
+	debug << "arcs:\n";
+	for (unsigned from = 0; from < _fsa.get_state_count(); ++from) {
+		for (const iw_to& iwto: _fsa.get_arcs(from)) {
+			unsigned iw = iwto.iw;
+			unsigned to = iwto.to;
+			char iwc = isalnum(iw) ? (char)iw : ' ';
+			debug << ' ' << from << ' ' << iw << '/' << iwc << ' ' << to << '\n';
+		}
+	}
+}
+
+// Deterministic Finite State Automaton used during match
+// Initial state is 0.
+// StateT is an unsigned integer type used for storing states
+// in the matrix of arcs, i.e., uint8_t, uint16_t or uint32_t.
+// The two largest values of StateT are reserved for special states.
+template <typename StateT>
+class fast_dfa {
+public:
+	typedef StateT state_type;
+
+	// "no arc", the rest of input is not accepted
+	static const StateT dead_state = (StateT)-1;
+	// "completely finite" state, the rest of input is accepted
+	static const StateT finite_sink_state = (StateT)-2;
+
+	// maximum number of states fitting to StateT
+	static const unsigned max_state_count = (unsigned)(StateT)-3 + 1;
+
+	// matrix of arcs is aligned to cache line, large one to huge page
+	static const size_t arcs_alignment = 64;
+	static const size_t huge_page_size = 2 << 20;
+
+protected:
+	StateT *m_arcs = nullptr;
+	bool m_owns_arcs = true;
+
+private:
+	unsigned m_state_count;
+	unsigned m_iw_count;
+	unsigned m_initial_state;
+	unsigned m_first_finite_state;
+
+	// States looping on every input are never left. Their arcs are
+	// replaced with finite_sink_state or dead_state, so that matching
+	// stops as soon as the result is known. Only the first iw_count
+	// columns are checked, the rest is padding never read by input.
+	void process_completely_finite_states(unsigned iw_count)
+	{
+		for (unsigned state = 0; state < m_state_count; ++state) {
+			//debug << "curr_state: " << state << '\n';
+			bool loop = true;
+			for (unsigned iw = 0; iw < iw_count; ++iw) {
+				if (m_arcs[state * m_iw_count + iw] != state) {
+					//debug << "  no\n";
+					loop = false;
+					break;
+				}
+			}
+			if (loop) {
+				StateT sink = (is_finite_state(state) ? finite_sink_state : dead_state);
+				for (unsigned iw = 0; iw < m_iw_count; ++iw) {
+					m_arcs[state * m_iw_count + iw] = sink;
+				}
+			}
+		}
+	}
+
+	// too lazy to implement them
+	fast_dfa& operator= (const fast_dfa &) = delete;
+	fast_dfa& operator= (fast_dfa &&) = delete;
+	fast_dfa(const fast_dfa &) = delete;
+	fast_dfa(fast_dfa &&) = delete;
+
+protected:
+	static StateT *alloc_arcs(size_t count)
+	{
+		size_t size = count * sizeof(StateT);
+		size_t alignment = (size >= huge_page_size ? huge_page_size : arcs_alignment);
+		void *arcs;
+		if (posix_memalign(&arcs, alignment, size))
+			throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+		if (alignment == huge_page_size)
+			madvise(arcs, size, MADV_HUGEPAGE);
+#endif
+		return (StateT *) arcs;
+	}
+
+	unsigned calc_iw_count(const fsa &dfa) const
+	{
+		unsigned ret = 0;
+		for (unsigned iw: dfa.get_iws()) {
+			if (iw >= ret)
+				ret = iw + 1;
+		}
+
+		return ret;
+	}
+
+public:
+	fast_dfa() noexcept {}
+
+	~fast_dfa()
+	{
+		clear();
+	}
+
+	void clear()
+	{
+		if (m_owns_arcs)
+			free(m_arcs);
+		m_arcs = nullptr;
+		m_owns_arcs = true;
+	}
+
+	// Uses matrix of arcs stored elsewhere, e.g., in mmap-ed cache file.
+	// The matrix should outlive DFA.
+	void attach(
+		const StateT *arcs, unsigned state_count, unsigned iw_count,
+		unsigned initial_state, unsigned first_finite_state)
+	{
+		clear();
+
+		m_arcs = const_cast<StateT *>(arcs);
+		m_owns_arcs = false;
+		m_state_count = state_count;
+		m_iw_count = iw_count;
+		m_initial_state = initial_state;
+		m_first_finite_state = first_finite_state;
+	}
+
+	inline const StateT *get_arcs_data() const noexcept {
+		return m_arcs;
+	}
+
+	// Returns true if DFA with state_count states fits to StateT
+	static bool fits(unsigned state_count) noexcept {
+		return state_count <= max_state_count;
+	}
+
+	// Convert slow 'fsa' to fast 'fast_dfa'.
+	// If invert is true, DFA accepts complement of language of dfa:
+	// finite states are flipped and missing arcs lead to
+	// finite_sink_state instead of dead_state.
+	void set(
+		const fsa &dfa,
+		unsigned iw_count = (unsigned)-1,
+		unsigned state_count = (unsigned) -1,
+		bool invert = false)
+	{
+		clear();
+
+		const set_uint& iws = dfa.get_iws();
+
+		// set m_state_count
+		if (state_count == (unsigned)-1)
+			m_state_count = (unsigned)dfa.get_state_count();
+		else
+			m_state_count = state_count;
+
+		assert(fits(m_state_count));
+
+		// calculating m_iw_count which is max input weight + 1
+		if (iw_count == (unsigned)-1)
+			m_iw_count = calc_iw_count(dfa);
+		else
+			m_iw_count = iw_count;
+
+		// optimize finite states by moving them to the right of
+		// non-finite states
+		std::vector<unsigned> state_map;
+		state_map.resize(m_state_count);
+
+		unsigned finite_count = 0;
+		for (unsigned state = 0; state < m_state_count; ++state)
+			finite_count += (dfa.is_finite_state(state) != invert);
+
+		m_first_finite_state = m_state_count - finite_count;
+		unsigned current_finite_state = m_first_finite_state;
+		unsigned current_nonfinite_state = 0;
+		for (unsigned state = 0; state < m_state_count; ++state) {
+			if (dfa.is_finite_state(state) != invert) {
+				state_map[state] = current_finite_state++;
+			} else {
+				state_map[state] = current_nonfinite_state++;
+			}
+		}
+		if (dfa.is_finite_state(0) != invert)
+			m_initial_state = m_first_finite_state;
+		else
+			m_initial_state = 0;
+
+		// from_state * iws -> to_state matrix.
+		// to state == dead_state means "no arc"
+		m_arcs = alloc_arcs(m_state_count * m_iw_count);
+		std::fill(m_arcs, m_arcs + m_state_count * m_iw_count,
+			(StateT) (invert ? finite_sink_state : dead_state));
+
+		for (unsigned from = 0; from < m_state_count; ++from) {
+			const vector_iwto& outgoing_arcs = dfa.get_arcs(from);
+
+			for (unsigned i = 0; i < outgoing_arcs.size(); ++i) {
+				unsigned iw = outgoing_arcs[i].iw;
+				unsigned to = outgoing_arcs[i].to;
+				m_arcs[state_map[from] * m_iw_count + iw] = state_map[to];
+			}
+		}
+
+		process_completely_finite_states(calc_iw_count(dfa));
+	}
+
+	// Renumbers states in order of decreasing visits[state] keeping
+	// non-finite states before finite ones, so that rows of hot states
+	// are adjacent in memory and share cache lines and TLB entries.
+	// Returns map from old state to new one.
+	std::vector<unsigned> renumber(const std::vector<uint64_t> &visits)
+	{
+		std::vector<unsigned> order(m_state_count);
+		std::iota(order.begin(), order.end(), 0);
+		auto hotter = [&visits](unsigned a, unsigned b) {
+			return visits[a] > visits[b];
+		};
+		std::stable_sort(order.begin(), order.begin() + m_first_finite_state, hotter);
+		std::stable_sort(order.begin() + m_first_finite_state, order.end(), hotter);
+
+		std::vector<unsigned> state_map(m_state_count);
+		for (unsigned state = 0; state < m_state_count; ++state)
+			state_map[order[state]] = state;
+
+		StateT *arcs = alloc_arcs(m_state_count * m_iw_count);
+		for (unsigned state = 0; state < m_state_count; ++state) {
+			for (unsigned iw = 0; iw < m_iw_count; ++iw) {
+				StateT to = m_arcs[order[state] * m_iw_count + iw];
+				arcs[state * m_iw_count + iw] =
+					(is_special_state(to) ? to : state_map[to]);
+			}
+		}
+
+		clear();
+		m_arcs = arcs;
+		m_initial_state = state_map[m_initial_state];
+		return state_map;
+	}
+
+	inline StateT get_arc(unsigned state, unsigned iw) const noexcept {
+		return m_arcs[state * m_iw_count + iw];
+	}
+
+	inline void set_arc(unsigned from, unsigned iw, StateT to) const noexcept {
+		assert(iw < m_iw_count);
+		assert(from < m_state_count);
+		assert(to >= finite_sink_state || to < m_state_count);
+		m_arcs[from * m_iw_count + iw] = to;
+	}
+
+	inline bool is_finite_state(unsigned state) const noexcept {
+		return state >= m_first_finite_state;
+	}
+
+	// Returns true for dead_state and finite_sink_state
+	static inline bool is_special_state(StateT state) noexcept {
+		return state >= finite_sink_state;
+	}
+
+	inline unsigned get_initial_state() const noexcept {
+		return m_initial_state;
+	}
+
+	inline unsigned get_state_count() const noexcept {
+		return m_state_count;
+	}
+
+	inline unsigned get_iw_count() const noexcept {
+		return m_iw_count;
+	}
+
+	inline unsigned get_first_finite_state() const noexcept {
+		return m_first_finite_state;
+	}
+};
+
+// The same as fast_dfa but uses shift instead of multiplication in
+// get_arc method
+template <typename StateT>
+class fast_dfa_shift: public fast_dfa<StateT> {
+private:
+	typedef fast_dfa<StateT> base;
+
+	unsigned m_iw_shift;
+
+	// Matrix of arcs for m_stride bytes per step, their input
+	// weights are concatenated as bit fields
+	StateT *m_stride_arcs = nullptr;
+	unsigned m_stride = 1;
+	unsigned m_stride_shift = 0;
+
+public:
+	~fast_dfa_shift()
+	{
+		clear_stride();
+	}
+
+	void clear()
+	{
+		clear_stride();
+		base::clear();
+	}
+
+	// Convert slow 'fsa' to fast 'fast_dfa'
+	void set(const fsa &dfa, bool invert = false)
+	{
+		clear_stride();
+		unsigned iw_count = nextpow2(this->calc_iw_count(dfa) - 1);
+		m_iw_shift = 31 - __builtin_clz(iw_count);
+		base::set(dfa, iw_count, (unsigned)-1, invert);
+	}
+
+	// iw_count should be a power of 2
+	void attach(
+		const StateT *arcs, unsigned state_count, unsigned iw_count,
+		unsigned initial_state, unsigned first_finite_state)
+	{
+		clear_stride();
+		m_iw_shift = 31 - __builtin_clz(iw_count);
+		base::attach(
+			arcs, state_count, iw_count, initial_state, first_finite_state);
+	}
+
+	void clear_stride()
+	{
+		free(m_stride_arcs);
+		m_stride_arcs = nullptr;
+		m_stride = 1;
+		m_stride_shift = 0;
+	}
+
+	// Builds matrix of arcs consuming stride (2 or 4) bytes per step
+	// by composing single-byte arcs. dead_state and finite_sink_state
+	// reached before the last byte are kept. Returns false if
+	// the matrix would take more than max_size bytes.
+	// Should be rebuilt whenever states are renumbered.
+	bool set_stride(unsigned stride, size_t max_size)
+	{
+		clear_stride();
+
+		unsigned half_shift = m_iw_shift * stride / 2;
+		if (stride != 2 && stride != 4)
+			return false;
+		if (2 * half_shift >= 32 ||
+			((uint64_t) this->get_state_count() << (2 * half_shift)) * sizeof(StateT) > max_size)
+		{
+			return false;
+		}
+
+		// stride 4 is stride 2 composed with itself
+		if (stride == 4 && !set_stride(2, max_size))
+			return false;
+
+		unsigned half_count = 1U << half_shift;
+		StateT *arcs = base::alloc_arcs((size_t) this->get_state_count() << (2 * half_shift));
+		for (unsigned state = 0; state < this->get_state_count(); ++state) {
+			for (unsigned first = 0; first < half_count; ++first) {
+				StateT middle = (stride == 2 ?
+					get_arc(state, first) : get_arc_stride(state, first));
+				for (unsigned second = 0; second < half_count; ++second) {
+					StateT to = middle;
+					if (!base::is_special_state(middle)) {
+						to = (stride == 2 ?
+							get_arc(middle, second) : get_arc_stride(middle, second));
+					}
+					arcs[((size_t) state << (2 * half_shift)) +
+						(first << half_shift) + second] = to;
+				}
+			}
+		}
+
+		clear_stride();
+		m_stride_arcs = arcs;
+		m_stride = stride;
+		m_stride_shift = 2 * half_shift;
+		return true;
+	}
+
+	inline StateT get_arc(unsigned state, unsigned iw) const noexcept {
+		return this->m_arcs[(state << m_iw_shift) + iw];
+	}
+
+	// iws are input weights of get_stride() bytes,
+	// the first one in the highest bits
+	inline StateT get_arc_stride(unsigned state, unsigned iws) const noexcept {
+		return m_stride_arcs[((size_t) state << m_stride_shift) + iws];
+	}
+
+	inline unsigned get_stride() const noexcept {
+		return m_stride;
+	}
+
+	inline unsigned get_iw_shift() const noexcept {
+		return m_iw_shift;
+	}
+};
+
+typedef std::bitset<256> byte_set;
+
+// Adds the other case of every ASCII letter in bytes
+static void fold_case(byte_set &bytes)
+{
+	for (unsigned c = 'a'; c <= 'z'; ++c) {
+		unsigned upper = c - 'a' + 'A';
+		if (bytes[c] || bytes[upper]) {
+			bytes.set(c);
+			bytes.set(upper);
+		}
+	}
+}
+
+static const struct {
+	const char *name;
+	int (*is_member)(int);
+} char_classes[] = {
+	{"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+	{"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+	{"lower", islower}, {"print", isprint}, {"punct", ispunct},
+	{"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+};
+
+// Parses bracket expression [p, end) found by glob_bracket_end().
+// Character classes like [:digit:] are ASCII ones regardless of locale.
+// If ignore_case is true, the set contains both cases of its letters.
+static bool parse_bracket(
+	byte_set &bytes, const char *p, const char *end, bool ignore_case,
+	std::string &error)
+{
+	bytes.reset();
+	++p;   // [
+	--end; // ]
+	bool negate = (*p == '!' || *p == '^');
+	if (negate)
+		++p;
+
+	while (p < end) {
+		if (p[0] == '[' && p[1] == ':') {
+			const char *name = p + 2;
+			const char *name_end = name;
+			while (isalpha((unsigned char) *name_end))
+				++name_end;
+			if (name_end[0] == ':' && name_end[1] == ']') {
+				std::string class_name(name, name_end);
+				bool found = false;
+				for (const auto &cc: char_classes) {
+					if (class_name != cc.name)
+						continue;
+					for (unsigned c = 0; c < 128; ++c) {
+						if (cc.is_member(c))
+							bytes.set(c);
+					}
+					found = true;
+				}
+				if (!found) {
+					error = "unknown character class '" + class_name + "'";
+					return false;
+				}
+				p = name_end + 2;
+				continue;
+			}
+		}
+
+		if (p[0] == '\\' && p + 1 < end)
+			++p;
+		unsigned first = (unsigned char) *p++;
+		unsigned last = first;
+		// '-' before ']' is a literal
+		if (p[0] == '-' && p + 1 < end) {
+			++p;
+			if (p[0] == '\\' && p + 1 < end)
+				++p;
+			last = (unsigned char) *p++;
+		}
+		for (unsigned c = first; c <= last; ++c)
+			bytes.set(c);
+	}
+
+	if (ignore_case)
+		fold_case(bytes);
+	if (negate)
+		bytes.flip();
+	return true;
+}
+
+// Build NFA from glob pattern. Besides '*' and '?' glob may contain
+// bracket expressions like [a-z], [!0-9] or [[:digit:]_] and
+// backslash escapes. If ignore_case is true, NFA is built over lower
+// case letters only and build_iwmap() maps upper case ones to them.
+// Returns false and sets error if glob is invalid.
+static bool parse_glob(
+	fsa &nfa, const char *glob, bool ignore_case, std::string &error)
+{
+	// bytes matched by every position of glob
+	struct position {
+		byte_set bytes;
+		bool star;
+	};
+	std::vector<position> positions;
+
+	for (const char *p = glob; *p; ) {
+		const char *end = glob_token_end(p);
+		position pos{byte_set(), *p == '*'};
+		if (*p == '*' || *p == '?') {
+			pos.bytes.set();
+		} else if (*p == '[' && end - p > 1) {
+			if (!parse_bracket(pos.bytes, p, end, ignore_case, error))
+				return false;
+		} else {
+			// literal or escaped byte
+			pos.bytes.set((unsigned char) end[-1]);
+			if (ignore_case)
+				fold_case(pos.bytes);
+		}
+		positions.push_back(pos);
+		p = end;
+	}
+
+	// iw == 0 means all bytes not mentioned in glob pattern.
+	// Byte 0 is never mentioned, so every set of bytes either
+	// contains all of them or none.
+	byte_set mentioned;
+	for (const position &pos: positions)
+		mentioned |= (pos.bytes[0] ? ~pos.bytes : pos.bytes);
+	mentioned.reset(0);
+	// every set contains both cases of a letter or none of them
+	if (ignore_case) {
+		for (unsigned c = 'A'; c <= 'Z'; ++c)
+			mentioned.reset(c);
+	}
+
+	// mentioned bytes may label no arcs, e.g., b in [!b]
+	for (unsigned iw = 1; iw < 256; ++iw) {
+		if (mentioned[iw])
+			nfa.add_iw(iw);
+	}
+
+	//
+	unsigned current_state = 0;
+	nfa.add_initial_state(0);
+	for (const position &pos: positions) {
+		unsigned to = current_state + !pos.star;
+		if (pos.bytes[0])
+			nfa.add_arc(current_state, 0, to);
+		for (unsigned iw = 1; iw < 256; ++iw) {
+			if (mentioned[iw] && pos.bytes[iw])
+				nfa.add_arc(current_state, iw, to);
+		}
+		current_state = to;
+	}
+	nfa.add_finite_state(current_state);
+	return true;
+}
+
+// Lets glob match any part of line. Initial states loop on every
+// byte, so match may start anywhere, finite ones loop too, so the
+// rest of line is accepted and DFA stops as soon as match ends.
+static void unanchor_nfa(fsa &nfa)
+{
+	set_uint iws = nfa.get_iws();
+	iws.insert(0);
+	for (unsigned iw: iws) {
+		for (unsigned state: nfa.get_initial_states())
+			nfa.add_arc(state, iw, state);
+		for (unsigned state: nfa.get_finite_states())
+			nfa.add_arc(state, iw, state);
+	}
+}
+
+// Interface class for DFA-based matcher
+class dfa_matcher_i: public globmatch {
+public:
+	virtual void set_nfa(const fsa& nfa) = 0;
+	// DFA is read-only after set_nfa(), so match() is safe
+	// to call from several threads simultaneously
+	virtual int match(const char *buffer, size_t buffer_size) const = 0;
+
+	virtual void match_batch(
+		const char *const *buffers, const size_t *buffer_sizes,
+		int *results, size_t count) const
+	{
+		for (size_t i = 0; i < count; ++i)
+			results[i] = match(buffers[i], buffer_sizes[i]);
+	}
+
+	virtual const char *skip(const char *buffer, const char * /*end*/) const
+	{
+		return buffer;
+	}
+
+	// matched part is the whole line
+	virtual int find(
+		const char *buffer, size_t buffer_size,
+		size_t *begin, size_t *end) const
+	{
+		*begin = 0;
+		*end = buffer_size;
+		return match(buffer, buffer_size);
+	}
+
+	// parts are collected and matched at the end of line
+	virtual void begin(globmatch_stream &stream) const
+	{
+		stream.result = -1;
+		stream.line.clear();
+	}
+
+	virtual bool feed(
+		globmatch_stream &stream, const char *buffer, size_t size) const
+	{
+		stream.line.append(buffer, size);
+		return false;
+	}
+
+	virtual int end(globmatch_stream &stream) const
+	{
+		return match(stream.line.data(), stream.line.size());
+	}
+};
+
+// The number of lines matched simultaneously by match_batch()
+static const size_t match_batch_size = GLOBMATCH_BATCH_SIZE;
+
+// Class for DFA-based matcher with weight mapping
+class dfa_matcher_iwmap_base: public dfa_matcher_i {
+protected:
+	uint8_t *m_iw_map = nullptr;  // map symbols used in regexp to 1, 2 etc., map others to 0
+	unsigned m_iw_map_size = 0;
+	minimization_algorithm m_minimization = HOPCROFT;
+	bool m_invert = false;
+	bool m_ignore_case = false;
+
+public:
+	dfa_matcher_iwmap_base() = default;
+	virtual ~dfa_matcher_iwmap_base()
+	{
+		delete [] m_iw_map;
+		m_iw_map = nullptr;
+	}
+
+	// should be called before set_nfa()
+	void set_minimization(minimization_algorithm algorithm)
+	{
+		m_minimization = algorithm;
+	}
+
+	// should be called before set_nfa()
+	void set_invert(bool invert)
+	{
+		m_invert = invert;
+	}
+
+	// should be called before set_nfa(), NFA should be built
+	// by parse_glob() with the same ignore_case
+	void set_ignore_case(bool ignore_case)
+	{
+		m_ignore_case = ignore_case;
+	}
+
+	// too lazy to implement them
+	dfa_matcher_iwmap_base& operator= (const dfa_matcher_iwmap_base &) = delete;
+	dfa_matcher_iwmap_base& operator= (dfa_matcher_iwmap_base &&) = delete;
+	dfa_matcher_iwmap_base(const dfa_matcher_iwmap_base &) = delete;
+	dfa_matcher_iwmap_base(dfa_matcher_iwmap_base &&) = delete;
+
+protected:
+	void build_iw_map(fsa& dst_fsa, const fsa& src_nfa)
+	{
+		dst_fsa.clear();
+
+		delete [] m_iw_map;
+		m_iw_map_size = 256;
+		m_iw_map = new uint8_t[m_iw_map_size];
+		memset(m_iw_map, 0, m_iw_map_size * sizeof(m_iw_map[0]));
+
+		unsigned *temp_iw_map = build_iwmap(
+			dst_fsa, m_iw_map_size, src_nfa, m_ignore_case);
+
+		for (unsigned i = 0; i < m_iw_map_size; ++i) {
+			m_iw_map[i] = temp_iw_map[i];
+		}
+
+		delete [] temp_iw_map;
+
+//		print_fsa(dst_fsa);
+	}
+};
+
+// Header of compiled DFA cache file. It is followed by matrix of arcs
+// aligned to cache_arcs_alignment, packed pattern IDs and the key
+// the DFA was built for.
+// Numbers are stored in native byte order, so cache files are not
+// portable between platforms.
+struct dfa_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t state_bits;
+	uint32_t state_count;
+	uint32_t iw_count;
+	uint32_t initial_state;
+	uint32_t first_finite_state;
+	uint32_t prefix_state;
+	uint32_t min_length;
+	uint32_t prefix_size;
+	uint32_t suffix_size;
+	uint32_t skip_size;
+	uint32_t key_size;
+	uint32_t invert;
+	uint32_t backward;
+	uint64_t arcs_offset;
+	uint64_t arcs_size;
+	uint64_t ids_size;
+	uint64_t checksum; // of the whole file with this field set to 0
+	uint8_t iw_map[256];
+	// prefix, suffix and skip literal
+	char literals[3 * max_literal_length];
+};
+
+static const char cache_magic[8] = {'M', 'Y', 'G', 'R', 'E', 'P', 'D', 'F'};
+static const uint32_t cache_version = 6;
+static const size_t cache_arcs_alignment = 64;
+
+// FNV-1a over 8-byte words, the rest is hashed byte by byte.
+// Parts of cache file are chained through h.
+static uint64_t cache_checksum(const void *data, size_t size, uint64_t h)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	for (; size >= sizeof(uint64_t); p += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		h ^= word;
+		h *= 1099511628211ULL;
+	}
+	for (; size > 0; ++p, --size) {
+		h ^= *p;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// Bytes leaving a state that loops on all other bytes
+struct escape_bytes {
+	static const unsigned max_count = 3;
+
+	uint8_t count = 0; // 0 means state is not accelerated
+	unsigned char bytes[max_count];
+};
+
+// Returns position of the first escape byte in [buffer, end) or end
+static inline const char *find_escape(
+	const char *buffer, const char *end, const escape_bytes &escape)
+{
+	if (escape.count == 1) {
+		const char *found = (const char *) memchr(buffer, escape.bytes[0], end - buffer);
+		return found ? found : end;
+	}
+
+#ifdef __SSE2__
+	// the last byte is repeated if there are 2 escape bytes
+	__m128i b0 = _mm_set1_epi8((char) escape.bytes[0]);
+	__m128i b1 = _mm_set1_epi8((char) escape.bytes[1]);
+	__m128i b2 = _mm_set1_epi8((char) escape.bytes[escape.count - 1]);
+	for (; end - buffer >= 16; buffer += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *) buffer);
+		__m128i eq = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(chunk, b0), _mm_cmpeq_epi8(chunk, b1)),
+			_mm_cmpeq_epi8(chunk, b2));
+		int mask = _mm_movemask_epi8(eq);
+		if (mask)
+			return buffer + __builtin_ctz(mask);
+	}
+#endif
+
+	for (; buffer < end; ++buffer) {
+		unsigned char c = *buffer;
+		for (unsigned i = 0; i < escape.count; ++i) {
+			if (c == escape.bytes[i])
+				return buffer;
+		}
+	}
+	return end;
+}
+
+static inline unsigned char to_lower_ascii(unsigned char c)
+{
+	return (unsigned char) (c - 'A') < 26 ? c - 'A' + 'a' : c;
+}
+
+// Compares n bytes of buffer regardless of case with lower case literal
+static inline bool equal_ignore_case(const char *buffer, const char *literal, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (to_lower_ascii(buffer[i]) != (unsigned char) literal[i])
+			return false;
+	}
+	return true;
+}
+
+// memmem(3) ignoring case for lower case literal. Both cases of
+// the first byte are searched by find_escape().
+static const char *find_literal_ignore_case(
+	const char *buffer, const char *end, const std::string &literal)
+{
+	if ((size_t) (end - buffer) < literal.size())
+		return nullptr;
+
+	escape_bytes first;
+	bool letter = (literal[0] >= 'a' && literal[0] <= 'z');
+	first.count = 1 + letter;
+	first.bytes[0] = literal[0];
+	first.bytes[1] = (letter ? literal[0] - 'a' + 'A' : literal[0]);
+
+	const char *last = end - literal.size() + 1;
+	for (; (buffer = find_escape(buffer, last, first)) < last; ++buffer) {
+		if (equal_ignore_case(buffer + 1, literal.data() + 1, literal.size() - 1))
+			return buffer;
+	}
+	return nullptr;
+}
+
+// Class used for matching using DFA with iwmap.
+// The smallest state type that fits minimal DFA is selected
+// by set_nfa() in order to reduce the size of matrix of arcs.
+// Literals extracted from minimal DFA are checked before running DFA.
+template <template <typename> class DFAType>
+class dfa_matcher_iwmap : public dfa_matcher_iwmap_base {
+private:
+	// glob pattern
+	DFAType<uint8_t> m_fast_dfa8;
+	DFAType<uint16_t> m_fast_dfa16;
+	DFAType<uint32_t> m_fast_dfa32;
+	unsigned m_state_bits = 0;
+
+	// prefilter
+	required_literals m_literals;
+	std::string m_skip_literal; // the longest of required literals
+	size_t m_min_length = 0;
+	unsigned m_prefix_state = 0; // DFA state after prefix (suffix if backward)
+
+	// DFA accepts reversed lines, they are scanned from the end
+	bool m_backward = false;
+
+	// The number of bytes consumed by one step of DFA, if its
+	// matrix of arcs is not larger than max_stride_arcs_size
+	unsigned m_stride = 1;
+	static const size_t max_stride_arcs_size = 1 << 20;
+
+	// Per-state bytes leaving states that loop on almost every byte,
+	// e.g., the initial state of *foo*. Input is skipped up to the next
+	// escape byte by memchr(3) or SIMD instead of stepping through DFA.
+	std::vector<escape_bytes> m_escapes;
+
+	// Reversed DFA of patterns that are unanchored, it finds
+	// the beginning of match by running back from its end
+	DFAType<uint32_t> m_start_dfa;
+	bool m_spans = false;
+
+	// Match result of finite states (from first finite state on),
+	// that is, 1 + index in m_pattern_id_sets.
+	// Empty if pattern IDs are not tracked, all matches return 1.
+	std::vector<uint32_t> m_accept;
+	std::vector<vector_uint> m_pattern_id_sets;
+
+	// mmap-ed cache file
+	void *m_cache_map = nullptr;
+	size_t m_cache_map_size = 0;
+
+	void unmap_cache()
+	{
+		if (m_cache_map)
+			munmap(m_cache_map, m_cache_map_size);
+		m_cache_map = nullptr;
+		m_cache_map_size = 0;
+	}
+
+	// Packs m_accept and m_pattern_id_sets for cache file:
+	// count, results of finite states, count, sets as (size, IDs...)
+	std::vector<uint32_t> pack_pattern_ids() const
+	{
+		std::vector<uint32_t> ret;
+		ret.push_back(m_accept.size());
+		ret.insert(ret.end(), m_accept.begin(), m_accept.end());
+		ret.push_back(m_pattern_id_sets.size());
+		for (const vector_uint &ids: m_pattern_id_sets) {
+			ret.push_back(ids.size());
+			ret.insert(ret.end(), ids.begin(), ids.end());
+		}
+		return ret;
+	}
+
+	bool unpack_pattern_ids(const std::vector<uint32_t> &packed)
+	{
+		m_accept.clear();
+		m_pattern_id_sets.clear();
+
+		size_t pos = 0;
+		if (packed.size() < 2 || packed[pos] > packed.size() - 2)
+			return false;
+		m_accept.assign(&packed[1], &packed[1] + packed[0]);
+		pos = 1 + packed[0];
+
+		uint32_t set_count = packed[pos++];
+		for (uint32_t i = 0; i < set_count; ++i) {
+			if (pos >= packed.size() || packed[pos] > packed.size() - pos - 1)
+				return false;
+			m_pattern_id_sets.push_back(vector_uint(
+				&packed[pos + 1], &packed[pos + 1] + packed[pos]));
+			pos += 1 + packed[pos];
+		}
+
+		for (uint32_t result: m_accept) {
+			if (result == 0 || result > set_count)
+				return false;
+		}
+		return pos == packed.size();
+	}
+
+	template <typename DFA>
+	void fill_cache_header(dfa_cache_header &header, const DFA &dfa) const
+	{
+		header.state_count = dfa.get_state_count();
+		header.iw_count = dfa.get_iw_count();
+		header.initial_state = dfa.get_initial_state();
+		header.first_finite_state = dfa.get_first_finite_state();
+		header.arcs_size = (uint64_t) header.state_count * header.iw_count *
+			sizeof(typename DFA::state_type);
+	}
+
+	template <typename DFA>
+	bool attach_cache(DFA &dfa, const dfa_cache_header &header)
+	{
+		// iw_count is a power of two, the shift is taken from it
+		if (header.iw_count == 0 || header.iw_count > 256 ||
+			(header.iw_count & (header.iw_count - 1)) != 0 ||
+			!DFA::fits(header.state_count) ||
+			header.initial_state >= header.state_count ||
+			header.first_finite_state > header.state_count ||
+			(header.prefix_state >= header.state_count &&
+				header.prefix_state != DFA::dead_state))
+		{
+			return false;
+		}
+		for (uint8_t iw: header.iw_map) {
+			if (iw >= header.iw_count)
+				return false;
+		}
+
+		if (header.arcs_size != (uint64_t) header.state_count * header.iw_count *
+			sizeof(typename DFA::state_type))
+		{
+			return false;
+		}
+
+		// the file may be modified keeping checksum, arcs should
+		// not lead out of matrix anyway
+		const typename DFA::state_type *arcs = (const typename DFA::state_type *)
+			((const char *) m_cache_map + header.arcs_offset);
+		size_t arc_count = (size_t) header.state_count * header.iw_count;
+		for (size_t i = 0; i < arc_count; ++i) {
+			if (!DFA::is_special_state(arcs[i]) && arcs[i] >= header.state_count)
+				return false;
+		}
+
+		dfa.attach(arcs, header.state_count, header.iw_count,
+			header.initial_state, header.first_finite_state);
+		return true;
+	}
+
+	// Match result for the final state
+	template <typename DFA>
+	inline int accept(const DFA &dfa, unsigned state) const
+	{
+		if (!dfa.is_finite_state(state))
+			return 0;
+		if (m_accept.empty())
+			return 1;
+		return m_accept[state - dfa.get_first_finite_state()];
+	}
+
+	// Match result for finite_sink_state entered from state.
+	// Inverted DFA enters it from any state via missing arcs.
+	template <typename DFA>
+	inline int sink_accept(const DFA &dfa, unsigned state) const
+	{
+		if (m_accept.empty())
+			return 1;
+		return m_accept[state - dfa.get_first_finite_state()];
+	}
+
+	// finite_sink_state is entered from the sink state itself
+	// (or via missing arc if inverted), so match result of
+	// the last regular state is returned
+	template <typename DFA>
+	inline int match_dfa(
+		const DFA &dfa, typename DFA::state_type state,
+		const char *buffer, size_t buffer_size) const
+	{
+		typename DFA::state_type next;
+		unsigned iw = 0;
+
+		if (DFA::is_special_state(state))
+			return 0;
+
+		for (size_t pos = 0; pos < buffer_size; ++pos) {
+			iw = (unsigned) (unsigned char) buffer[pos];
+			iw = m_iw_map[iw];
+			next = dfa.get_arc(state, iw);
+			if (DFA::is_special_state(next))
+				return next == DFA::finite_sink_state ? sink_accept(dfa, state) : 0;
+			if (next == state && m_escapes[state].count) {
+				// the next byte examined is escape one
+				pos = find_escape(buffer + pos + 1, buffer + buffer_size,
+					m_escapes[state]) - buffer - 1;
+			}
+			state = next;
+		}
+
+		return accept(dfa, state);
+	}
+
+	// The same as match_dfa but Stride bytes are consumed per step,
+	// the rest of buffer shorter than Stride is matched by match_dfa
+	template <unsigned Stride, typename DFA>
+	inline int match_dfa_stride(
+		const DFA &dfa, typename DFA::state_type state,
+		const char *buffer, size_t buffer_size) const
+	{
+		typename DFA::state_type next;
+		unsigned iw_shift = dfa.get_iw_shift();
+		size_t pos = 0;
+
+		if (DFA::is_special_state(state))
+			return 0;
+
+		while (pos + Stride <= buffer_size) {
+			unsigned iws = 0;
+			for (unsigned i = 0; i < Stride; ++i)
+				iws = (iws << iw_shift) | m_iw_map[(unsigned char) buffer[pos + i]];
+			next = dfa.get_arc_stride(state, iws);
+			if (DFA::is_special_state(next))
+				return next == DFA::finite_sink_state ? sink_accept(dfa, state) : 0;
+			pos += Stride;
+			if (next == state && m_escapes[state].count) {
+				pos = find_escape(buffer + pos, buffer + buffer_size,
+					m_escapes[state]) - buffer;
+			}
+			state = next;
+		}
+
+		return match_dfa(dfa, state, buffer + pos, buffer_size - pos);
+	}
+
+	template <typename DFA>
+	inline int match_dfa_forward(
+		const DFA &dfa, typename DFA::state_type state,
+		const char *buffer, size_t buffer_size) const
+	{
+		switch (dfa.get_stride()) {
+			case 4:
+				return match_dfa_stride<4>(dfa, state, buffer, buffer_size);
+			case 2:
+				return match_dfa_stride<2>(dfa, state, buffer, buffer_size);
+			default:
+				return match_dfa(dfa, state, buffer, buffer_size);
+		}
+	}
+
+	// The same as match_dfa but DFA is reversed and
+	// [buffer, buffer+buffer_size) is scanned from the end
+	template <typename DFA>
+	inline int match_dfa_backward(
+		const DFA &dfa, typename DFA::state_type state,
+		const char *buffer, size_t buffer_size) const
+	{
+		typename DFA::state_type next;
+
+		if (DFA::is_special_state(state))
+			return 0;
+
+		for (size_t pos = buffer_size; pos-- > 0; ) {
+			next = dfa.get_arc(state, m_iw_map[(unsigned char) buffer[pos]]);
+			if (DFA::is_special_state(next))
+				return next == DFA::finite_sink_state ? sink_accept(dfa, state) : 0;
+			if (next == state && m_escapes[state].count == 1) {
+				// the next byte examined is escape one
+				const char *found = (const char *) memrchr(
+					buffer, m_escapes[state].bytes[0], pos);
+				pos = (found ? found - buffer + 1 : 0);
+			}
+			state = next;
+		}
+
+		return accept(dfa, state);
+	}
+
+	// Steps up to match_batch_size lines through DFA in lockstep,
+	// one byte of every line per round, so that independent loads
+	// from matrix of arcs overlap. Finished lanes are removed.
+	template <typename DFA>
+	void match_dfa_batch(
+		const DFA &dfa, const char *const *buffers, const size_t *buffer_sizes,
+		int *results, size_t count) const
+	{
+		typedef typename DFA::state_type state_type;
+
+		// active lanes
+		state_type states[match_batch_size];
+		state_type prev_states[match_batch_size];
+		const unsigned char *pos[match_batch_size];
+		size_t remains[match_batch_size];
+		size_t lane2line[match_batch_size];
+		size_t active = 0;
+
+		assert(count <= match_batch_size);
+
+		for (size_t i = 0; i < count; ++i) {
+			if (!match_literals(buffers[i], buffer_sizes[i])) {
+				results[i] = m_invert;
+			} else if (DFA::is_special_state(m_prefix_state)) {
+				results[i] = 0;
+			} else {
+				size_t prefix_size = m_literals.prefix.size();
+				states[active] = m_prefix_state;
+				prev_states[active] = m_prefix_state;
+				pos[active] = (const unsigned char *) buffers[i] + prefix_size;
+				remains[active] = buffer_sizes[i] - prefix_size;
+				lane2line[active] = i;
+				++active;
+			}
+		}
+
+		while (active > 0) {
+			for (size_t l = 0; l < active; ) {
+				state_type state = states[l];
+				int result = -1;
+				if (DFA::is_special_state(state)) {
+					result = (state == DFA::finite_sink_state ?
+						sink_accept(dfa, prev_states[l]) : 0);
+				} else if (remains[l] == 0) {
+					result = accept(dfa, state);
+				}
+
+				if (result >= 0) {
+					results[lane2line[l]] = result;
+					--active;
+					states[l] = states[active];
+					prev_states[l] = prev_states[active];
+					pos[l] = pos[active];
+					remains[l] = remains[active];
+					lane2line[l] = lane2line[active];
+					continue;
+				}
+
+				prev_states[l] = state;
+				states[l] = dfa.get_arc(state, m_iw_map[*pos[l]++]);
+				--remains[l];
+				if (states[l] == state && m_escapes[state].count) {
+					const unsigned char *escape = (const unsigned char *) find_escape(
+						(const char *) pos[l], (const char *) pos[l] + remains[l],
+						m_escapes[state]);
+					remains[l] -= escape - pos[l];
+					pos[l] = escape;
+				}
+				++l;
+			}
+		}
+	}
+
+	// Checks line length and anchored literals
+	inline bool match_literals(const char *buffer, size_t buffer_size) const
+	{
+		const std::string &prefix = m_literals.prefix;
+		const std::string &suffix = m_literals.suffix;
+
+		if (buffer_size < m_min_length)
+			return false;
+		if (m_ignore_case) {
+			return equal_ignore_case(buffer, prefix.data(), prefix.size()) &&
+				equal_ignore_case(buffer + buffer_size - suffix.size(),
+					suffix.data(), suffix.size());
+		}
+		if (!prefix.empty() &&
+			(buffer[0] != prefix[0] ||
+			 memcmp(buffer, prefix.data(), prefix.size())))
+		{
+			return false;
+		}
+		if (!suffix.empty() &&
+			(buffer[buffer_size - 1] != suffix.back() ||
+			 memcmp(buffer + buffer_size - suffix.size(), suffix.data(), suffix.size())))
+		{
+			return false;
+		}
+
+		return true;
+	}
+
+	// The same as match_dfa but the state is kept in stream
+	// until the result is known
+	template <typename DFA>
+	bool feed_dfa(
+		const DFA &dfa, globmatch_stream &stream,
+		const char *buffer, size_t buffer_size) const
+	{
+		typename DFA::state_type next;
+		unsigned state = stream.state;
+
+		for (size_t pos = 0; pos < buffer_size; ++pos) {
+			next = dfa.get_arc(state, m_iw_map[(unsigned char) buffer[pos]]);
+			if (DFA::is_special_state(next)) {
+				stream.result = (next == DFA::finite_sink_state ? sink_accept(dfa, state) : 0);
+				return true;
+			}
+			if (next == state && m_escapes[state].count) {
+				pos = find_escape(buffer + pos + 1, buffer + buffer_size,
+					m_escapes[state]) - buffer - 1;
+			}
+			state = next;
+		}
+
+		stream.state = state;
+		return false;
+	}
+
+	// Returns the end of the shortest prefix of buffer accepted by
+	// unanchored DFA, or (size_t)-1. The result is stored to *result.
+	template <typename DFA>
+	size_t find_end(
+		const DFA &dfa, const char *buffer, size_t buffer_size,
+		int *result) const
+	{
+		unsigned state = dfa.get_initial_state();
+		size_t pos = 0;
+
+		while (!dfa.is_finite_state(state)) {
+			if (pos == buffer_size)
+				return (size_t)-1;
+			unsigned next = dfa.get_arc(state, m_iw_map[(unsigned char) buffer[pos++]]);
+			if (next == DFA::dead_state)
+				return (size_t)-1;
+			if (next == state && m_escapes[state].count) {
+				pos = find_escape(buffer + pos, buffer + buffer_size,
+					m_escapes[state]) - buffer;
+			}
+			state = next;
+		}
+
+		*result = accept(dfa, state);
+		return pos;
+	}
+
+	// Returns the beginning of the longest match ending at end
+	size_t find_start(const char *buffer, size_t end) const
+	{
+		typedef DFAType<uint32_t> DFA;
+		unsigned state = m_start_dfa.get_initial_state();
+		size_t ret = end;
+
+		for (size_t pos = end; pos-- > 0; ) {
+			state = m_start_dfa.get_arc(state, m_iw_map[(unsigned char) buffer[pos]]);
+			if (state == DFA::dead_state)
+				break;
+			// the rest of line matches too
+			if (state == DFA::finite_sink_state)
+				return 0;
+			if (m_start_dfa.is_finite_state(state))
+				ret = pos;
+		}
+		return ret;
+	}
+
+	// Runs DFA over prefix literal, or over reversed suffix literal
+	// if scanning backward. The sink state is not left
+	// for finite_sink_state in order to keep its match result.
+	template <typename DFA>
+	unsigned calc_prefix_state(const DFA &dfa) const
+	{
+		std::string literal = m_literals.prefix;
+		if (m_backward)
+			literal.assign(m_literals.suffix.rbegin(), m_literals.suffix.rend());
+
+		unsigned state = dfa.get_initial_state();
+		for (char c: literal) {
+			unsigned next = dfa.get_arc(state, m_iw_map[(unsigned char) c]);
+			if (next == DFA::finite_sink_state)
+				break;
+			state = next;
+		}
+		return state;
+	}
+
+	// Counts visits of DFA states while matching lines of sample
+	// and renumbers states from hot to cold
+	template <typename DFA>
+	void train_dfa(DFA &dfa, const char *buffer, size_t size)
+	{
+		std::vector<uint64_t> visits(dfa.get_state_count());
+		const char *end = buffer + size;
+
+		while (buffer < end) {
+			const char *eol = (const char *) memchr(buffer, '\n', end - buffer);
+			size_t line_len = (eol ? eol : end) - buffer;
+			unsigned state = m_prefix_state;
+			if (!match_literals(buffer, line_len)) {
+				// DFA is not run
+			} else if (m_backward) {
+				for (size_t pos = line_len - m_literals.suffix.size();
+					pos-- > 0 && !DFA::is_special_state(state); )
+				{
+					++visits[state];
+					state = dfa.get_arc(state, m_iw_map[(unsigned char) buffer[pos]]);
+				}
+			} else {
+				for (size_t pos = m_literals.prefix.size();
+					pos < line_len && !DFA::is_special_state(state); ++pos)
+				{
+					++visits[state];
+					state = dfa.get_arc(state, m_iw_map[(unsigned char) buffer[pos]]);
+				}
+			}
+			buffer = (eol ? eol + 1 : end);
+		}
+
+		unsigned first_finite = dfa.get_first_finite_state();
+		std::vector<unsigned> state_map = dfa.renumber(visits);
+		if (!DFA::is_special_state(m_prefix_state))
+			m_prefix_state = state_map[m_prefix_state];
+
+		if (!m_accept.empty()) {
+			std::vector<uint32_t> accept(m_accept.size());
+			for (unsigned i = 0; i < m_accept.size(); ++i)
+				accept[state_map[first_finite + i] - first_finite] = m_accept[i];
+			m_accept.swap(accept);
+		}
+	}
+
+	// Should be called whenever states are renumbered
+	template <typename DFA>
+	void set_escapes(const DFA &dfa)
+	{
+		m_escapes.assign(dfa.get_state_count(), escape_bytes());
+		for (unsigned state = 0; state < dfa.get_state_count(); ++state) {
+			escape_bytes escape;
+			unsigned count = 0;
+			for (unsigned c = 0; c < m_iw_map_size && count <= escape.max_count; ++c) {
+				if (dfa.get_arc(state, m_iw_map[c]) != state) {
+					if (count < escape.max_count)
+						escape.bytes[count] = c;
+					++count;
+				}
+			}
+			if (count > 0 && count <= escape.max_count) {
+				escape.count = count;
+				m_escapes[state] = escape;
+			}
+		}
+	}
+
+	void set_escapes()
+	{
+		switch (m_state_bits) {
+			case 8:
+				set_escapes(m_fast_dfa8);
+				break;
+			case 16:
+				set_escapes(m_fast_dfa16);
+				break;
+			default:
+				set_escapes(m_fast_dfa32);
+				break;
+		}
+	}
+
+	// Should be called whenever states are renumbered.
+	// Step consuming several bytes cannot tell from which state
+	// finite_sink_state was entered, so pattern IDs disable it.
+	// Backward scanning is done byte by byte.
+	template <typename DFA>
+	void build_stride(DFA &dfa)
+	{
+		dfa.clear_stride();
+		if (!m_accept.empty() || m_backward)
+			return;
+		for (unsigned stride = m_stride; stride > 1; stride /= 2) {
+			if (dfa.set_stride(stride, max_stride_arcs_size))
+				return;
+		}
+	}
+
+	void build_stride()
+	{
+		switch (m_state_bits) {
+			case 8:
+				build_stride(m_fast_dfa8);
+				break;
+			case 16:
+				build_stride(m_fast_dfa16);
+				break;
+			default:
+				build_stride(m_fast_dfa32);
+				break;
+		}
+	}
+
+	// fast_dfa places finite states after non-finite ones
+	// keeping their order
+	void set_accept(const fsa &dfa)
+	{
+		m_accept.clear();
+		m_pattern_id_sets.clear();
+		if (!dfa.has_pattern_ids())
+			return;
+
+		std::map<vector_uint, uint32_t> ids2result;
+		for (unsigned state = 0; state < dfa.get_state_count(); ++state) {
+			if (!dfa.is_finite_state(state))
+				continue;
+
+			const vector_uint &ids = dfa.get_pattern_ids(state);
+			auto found = ids2result.insert(
+				std::make_pair(ids, m_pattern_id_sets.size() + 1));
+			if (found.second)
+				m_pattern_id_sets.push_back(ids);
+			m_accept.push_back(found.first->second);
+		}
+	}
+
+	void set_literals(const fsa &dfa)
+	{
+		// input weights mapped to exactly one byte may be literals,
+		// if case is ignored, lower case letters stand for both cases
+		std::vector<int> iw2byte(256, -1);
+		std::vector<unsigned> iw_byte_count(256, 0);
+		for (unsigned i = 0; i < m_iw_map_size; ++i) {
+			iw2byte[m_iw_map[i]] = i;
+			++iw_byte_count[m_iw_map[i]];
+		}
+		for (unsigned iw = 0; iw < iw2byte.size(); ++iw) {
+			int byte = iw2byte[iw];
+			bool letter = (m_ignore_case && byte >= 'a' && byte <= 'z');
+			if (iw_byte_count[iw] != 1u + letter)
+				iw2byte[iw] = -1;
+		}
+
+		dfa_literals(m_literals, dfa, iw2byte);
+
+		m_skip_literal = m_literals.infix;
+		if (m_literals.prefix.size() > m_skip_literal.size())
+			m_skip_literal = m_literals.prefix;
+		if (m_literals.suffix.size() > m_skip_literal.size())
+			m_skip_literal = m_literals.suffix;
+		// single byte is usually too frequent for skipping
+		if (m_skip_literal.size() < min_skip_literal_length)
+			m_skip_literal.clear();
+
+		m_min_length = std::max(
+			m_literals.prefix.size(), m_literals.suffix.size());
+	}
+
+public:
+	dfa_matcher_iwmap() = default;
+
+	// should be called before set_nfa() or load(), stride is 1, 2 or 4
+	void set_stride(unsigned stride)
+	{
+		m_stride = stride;
+	}
+
+	~dfa_matcher_iwmap()
+	{
+		m_fast_dfa8.clear();
+		m_fast_dfa16.clear();
+		m_fast_dfa32.clear();
+		m_start_dfa.clear();
+		unmap_cache();
+	}
+
+	// Enables exact spans reported by find(). nfa is union of patterns
+	// before unanchor_nfa(), the DFA should be unanchored one.
+	// Should be called after set_nfa() or load().
+	void set_span_nfa(const fsa &nfa)
+	{
+		// bytes are mapped to the same classes as for unanchored NFA,
+		// because loops of unanchor_nfa() are labeled by all of them
+		fsa nfa_iwmap;
+		for (unsigned state: nfa.get_initial_states())
+			nfa_iwmap.add_initial_state(state);
+		for (unsigned state: nfa.get_finite_states())
+			nfa_iwmap.add_finite_state(state);
+		for (unsigned from = 0; from < nfa.get_state_count(); ++from) {
+			for (const iw_to &arc: nfa.get_arcs(from))
+				nfa_iwmap.add_arc(from, m_iw_map[arc.iw], arc.to);
+		}
+
+		fsa inv;
+		invert(inv, nfa_iwmap);
+		fsa dfa;
+		nfa2mindfa(dfa, inv);
+		for (unsigned i = 0; i < m_iw_map_size; ++i)
+			dfa.add_iw(m_iw_map[i]);
+
+		m_start_dfa.set(dfa);
+		m_spans = true;
+	}
+
+	virtual void set_nfa(const fsa& nfa)
+	{
+		m_fast_dfa8.clear();
+		m_fast_dfa16.clear();
+		m_fast_dfa32.clear();
+		unmap_cache();
+
+		fsa nfa_iwmap;
+		build_iw_map(nfa_iwmap, nfa);
+
+		// Brzozowski algorithm loses pattern IDs
+		fsa dfa;
+		nfa2mindfa(dfa, nfa_iwmap,
+			nfa.has_pattern_ids() ? HOPCROFT : m_minimization);
+
+//		print_fsa(dfa);
+
+		// matrix of arcs has columns for byte classes labeling no arcs too
+		set_uint iws(m_iw_map, m_iw_map + m_iw_map_size);
+		for (unsigned iw: iws)
+			dfa.add_iw(iw);
+
+		set_literals(dfa);
+		set_accept(dfa);
+
+		// Lines are scanned backward if only reversed DFA may stop
+		// early, e.g., *ppler is decided by 5 bytes at the end of line.
+		// Reversed DFA is built from minimal one, pattern IDs are lost.
+		fsa reversed;
+		m_backward = false;
+		if (!dfa.has_pattern_ids() && !dfa_stops_early(dfa, iws)) {
+			fsa inv;
+			invert(inv, dfa);
+			nfa2mindfa(reversed, inv);
+			for (unsigned iw: iws)
+				reversed.add_iw(iw);
+			m_backward = dfa_stops_early(reversed, iws);
+		}
+		const fsa &scan_dfa = (m_backward ? reversed : dfa);
+
+		//
+		unsigned state_count = scan_dfa.get_state_count();
+		if (DFAType<uint8_t>::fits(state_count)) {
+			m_state_bits = 8;
+			m_fast_dfa8.set(scan_dfa, m_invert);
+			m_prefix_state = calc_prefix_state(m_fast_dfa8);
+		} else if (DFAType<uint16_t>::fits(state_count)) {
+			m_state_bits = 16;
+			m_fast_dfa16.set(scan_dfa, m_invert);
+			m_prefix_state = calc_prefix_state(m_fast_dfa16);
+		} else {
+			m_state_bits = 32;
+			m_fast_dfa32.set(scan_dfa, m_invert);
+			m_prefix_state = calc_prefix_state(m_fast_dfa32);
+		}
+		set_escapes();
+		build_stride();
+	}
+
+	// Saves compiled DFA to cache file. key is what DFA was built for,
+	// e.g., patterns and options. File is replaced atomically.
+	bool save(const char *filename, const std::string &key) const
+	{
+		dfa_cache_header header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, cache_magic, sizeof(header.magic));
+		header.version = cache_version;
+		header.state_bits = m_state_bits;
+		header.prefix_state = m_prefix_state;
+		header.min_length = m_min_length;
+		header.prefix_size = m_literals.prefix.size();
+		header.suffix_size = m_literals.suffix.size();
+		header.skip_size = m_skip_literal.size();
+		header.key_size = key.size();
+		header.invert = m_invert;
+		header.backward = m_backward;
+		memcpy(header.iw_map, m_iw_map, sizeof(header.iw_map));
+		memcpy(header.literals, m_literals.prefix.data(), header.prefix_size);
+		memcpy(header.literals + max_literal_length,
+			m_literals.suffix.data(), header.suffix_size);
+		memcpy(header.literals + 2 * max_literal_length,
+			m_skip_literal.data(), header.skip_size);
+
+		const void *arcs;
+		switch (m_state_bits) {
+			case 8:
+				fill_cache_header(header, m_fast_dfa8);
+				arcs = m_fast_dfa8.get_arcs_data();
+				break;
+			case 16:
+				fill_cache_header(header, m_fast_dfa16);
+				arcs = m_fast_dfa16.get_arcs_data();
+				break;
+			default:
+				fill_cache_header(header, m_fast_dfa32);
+				arcs = m_fast_dfa32.get_arcs_data();
+				break;
+		}
+		header.arcs_offset = (sizeof(header) + cache_arcs_alignment - 1) /
+			cache_arcs_alignment * cache_arcs_alignment;
+
+		std::vector<uint32_t> packed_ids = pack_pattern_ids();
+		header.ids_size = packed_ids.size() * sizeof(packed_ids[0]);
+
+		static const char padding[cache_arcs_alignment] = {0};
+		uint64_t h = 14695981039346656037ULL;
+		h = cache_checksum(&header, sizeof(header), h);
+		h = cache_checksum(padding, header.arcs_offset - sizeof(header), h);
+		h = cache_checksum(arcs, header.arcs_size, h);
+		h = cache_checksum(packed_ids.data(), header.ids_size, h);
+		h = cache_checksum(key.data(), key.size(), h);
+		header.checksum = h;
+
+		std::string tmp_filename = filename;
+		tmp_filename += ".tmp." + std::to_string(getpid());
+		FILE *file = fopen(tmp_filename.c_str(), "wb");
+		if (!file)
+			return false;
+
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+			fwrite(padding, 1, header.arcs_offset - sizeof(header), file) ==
+				header.arcs_offset - sizeof(header) &&
+			fwrite(arcs, 1, header.arcs_size, file) == header.arcs_size &&
+			fwrite(packed_ids.data(), 1, header.ids_size, file) == header.ids_size &&
+			fwrite(key.data(), 1, key.size(), file) == key.size();
+		ok = (fclose(file) == 0) && ok;
+
+		if (!ok || rename(tmp_filename.c_str(), filename) == -1) {
+			unlink(tmp_filename.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	// Returns true if the mapped cache file is not corrupted.
+	// Sizes in header are checked already.
+	bool check_cache_checksum(const dfa_cache_header &header) const
+	{
+		const char *file = (const char *) m_cache_map;
+		dfa_cache_header unsummed;
+		memcpy(&unsummed, &header, sizeof(unsummed));
+		unsummed.checksum = 0;
+
+		uint64_t h = 14695981039346656037ULL;
+		h = cache_checksum(&unsummed, sizeof(unsummed), h);
+		h = cache_checksum(file + sizeof(header), header.arcs_offset - sizeof(header), h);
+		h = cache_checksum(file + header.arcs_offset, header.arcs_size, h);
+		h = cache_checksum(file + header.arcs_offset + header.arcs_size,
+			header.ids_size, h);
+		h = cache_checksum(file + header.arcs_offset + header.arcs_size +
+			header.ids_size, header.key_size, h);
+		return h == header.checksum;
+	}
+
+	// Loads DFA from cache file saved by save() for the same key.
+	// Matrix of arcs is used directly from mmap-ed file.
+	// Returns false if file is absent, broken or was built for other key.
+	bool load(const char *filename, const std::string &key)
+	{
+		int fd = open(filename, O_RDONLY);
+		if (fd == -1)
+			return false;
+
+		struct stat st;
+		if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(dfa_cache_header)) {
+			close(fd);
+			return false;
+		}
+
+		void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+			return false;
+
+		m_fast_dfa8.clear();
+		m_fast_dfa16.clear();
+		m_fast_dfa32.clear();
+		unmap_cache();
+		m_cache_map = map;
+		m_cache_map_size = st.st_size;
+
+		const dfa_cache_header &header = *(const dfa_cache_header *) map;
+		if (memcmp(header.magic, cache_magic, sizeof(header.magic)) ||
+			header.version != cache_version ||
+			header.invert != m_invert ||
+			header.prefix_size > max_literal_length ||
+			header.suffix_size > max_literal_length ||
+			header.skip_size > max_literal_length ||
+			header.min_length < header.prefix_size ||
+			header.min_length < header.suffix_size ||
+			header.ids_size % sizeof(uint32_t) != 0 ||
+			header.arcs_offset < sizeof(dfa_cache_header) ||
+			header.arcs_offset % cache_arcs_alignment != 0 ||
+			header.arcs_offset > (uint64_t) st.st_size ||
+			header.arcs_size > (uint64_t) st.st_size - header.arcs_offset ||
+			header.ids_size > (uint64_t) st.st_size - header.arcs_offset -
+				header.arcs_size ||
+			header.key_size != (uint64_t) st.st_size - header.arcs_offset -
+				header.arcs_size - header.ids_size ||
+			header.key_size != key.size() ||
+			memcmp((const char *) map + header.arcs_offset + header.arcs_size +
+				header.ids_size, key.data(), key.size()) ||
+			!check_cache_checksum(header))
+		{
+			unmap_cache();
+			return false;
+		}
+
+		// IDs may be unaligned
+		std::vector<uint32_t> packed_ids(header.ids_size / sizeof(uint32_t));
+		memcpy(packed_ids.data(),
+			(const char *) map + header.arcs_offset + header.arcs_size,
+			header.ids_size);
+		if (!unpack_pattern_ids(packed_ids)) {
+			unmap_cache();
+			return false;
+		}
+
+		bool ok;
+		m_state_bits = header.state_bits;
+		switch (m_state_bits) {
+			case 8:
+				ok = attach_cache(m_fast_dfa8, header);
+				break;
+			case 16:
+				ok = attach_cache(m_fast_dfa16, header);
+				break;
+			case 32:
+				ok = attach_cache(m_fast_dfa32, header);
+				break;
+			default:
+				ok = false;
+		}
+		if (!ok || (!m_accept.empty() &&
+			m_accept.size() != header.state_count - header.first_finite_state))
+		{
+			unmap_cache();
+			return false;
+		}
+
+		delete [] m_iw_map;
+		m_iw_map_size = 256;
+		m_iw_map = new uint8_t[m_iw_map_size];
+		memcpy(m_iw_map, header.iw_map, m_iw_map_size);
+
+		m_prefix_state = header.prefix_state;
+		m_backward = header.backward;
+		m_min_length = header.min_length;
+		m_literals = required_literals();
+		m_literals.prefix.assign(header.literals, header.prefix_size);
+		m_literals.suffix.assign(header.literals + max_literal_length, header.suffix_size);
+		m_skip_literal.assign(header.literals + 2 * max_literal_length, header.skip_size);
+		set_escapes();
+		build_stride();
+		return true;
+	}
+
+	// Lays out DFA states for matching input like sample
+	void train(const char *buffer, size_t size)
+	{
+		switch (m_state_bits) {
+			case 8:
+				train_dfa(m_fast_dfa8, buffer, size);
+				break;
+			case 16:
+				train_dfa(m_fast_dfa16, buffer, size);
+				break;
+			default:
+				train_dfa(m_fast_dfa32, buffer, size);
+				break;
+		}
+		set_escapes();
+		build_stride();
+	}
+
+	virtual int match(const char *buffer, size_t buffer_size) const
+	{
+		if (!match_literals(buffer, buffer_size))
+			return m_invert;
+
+		if (m_backward) {
+			// DFA confirms candidate from the end right before suffix
+			buffer_size -= m_literals.suffix.size();
+			switch (m_state_bits) {
+				case 8:
+					return match_dfa_backward(m_fast_dfa8, m_prefix_state, buffer, buffer_size);
+				case 16:
+					return match_dfa_backward(m_fast_dfa16, m_prefix_state, buffer, buffer_size);
+				default:
+					return match_dfa_backward(m_fast_dfa32, m_prefix_state, buffer, buffer_size);
+			}
+		}
+
+		// DFA confirms candidate starting right after prefix
+		buffer += m_literals.prefix.size();
+		buffer_size -= m_literals.prefix.size();
+
+		switch (m_state_bits) {
+			case 8:
+				return match_dfa_forward(m_fast_dfa8, m_prefix_state, buffer, buffer_size);
+			case 16:
+				return match_dfa_forward(m_fast_dfa16, m_prefix_state, buffer, buffer_size);
+			default:
+				return match_dfa_forward(m_fast_dfa32, m_prefix_state, buffer, buffer_size);
+		}
+	}
+
+	virtual void match_batch(
+		const char *const *buffers, const size_t *buffer_sizes,
+		int *results, size_t count) const
+	{
+		// lines scanned backward are matched one by one
+		if (m_backward) {
+			dfa_matcher_i::match_batch(buffers, buffer_sizes, results, count);
+			return;
+		}
+
+		switch (m_state_bits) {
+			case 8:
+				match_dfa_batch(m_fast_dfa8, buffers, buffer_sizes, results, count);
+				break;
+			case 16:
+				match_dfa_batch(m_fast_dfa16, buffers, buffer_sizes, results, count);
+				break;
+			default:
+				match_dfa_batch(m_fast_dfa32, buffers, buffer_sizes, results, count);
+				break;
+		}
+	}
+
+	// Match ends where unanchored DFA enters finite state first,
+	// it starts as early as possible
+	virtual int find(
+		const char *buffer, size_t buffer_size,
+		size_t *begin, size_t *end) const
+	{
+		if (!m_spans || m_backward)
+			return dfa_matcher_i::find(buffer, buffer_size, begin, end);
+		if (!match_literals(buffer, buffer_size))
+			return 0;
+
+		int result = 0;
+		size_t match_end;
+		switch (m_state_bits) {
+			case 8:
+				match_end = find_end(m_fast_dfa8, buffer, buffer_size, &result);
+				break;
+			case 16:
+				match_end = find_end(m_fast_dfa16, buffer, buffer_size, &result);
+				break;
+			default:
+				match_end = find_end(m_fast_dfa32, buffer, buffer_size, &result);
+				break;
+		}
+		if (match_end == (size_t)-1)
+			return 0;
+
+		*begin = find_start(buffer, match_end);
+		*end = match_end;
+		return result;
+	}
+
+	// Lines scanned backward are collected by dfa_matcher_i.
+	// Prefilter is not used, DFA starts from the initial state.
+	virtual void begin(globmatch_stream &stream) const
+	{
+		if (m_backward) {
+			dfa_matcher_i::begin(stream);
+			return;
+		}
+
+		stream.result = -1;
+		switch (m_state_bits) {
+			case 8:
+				stream.state = m_fast_dfa8.get_initial_state();
+				break;
+			case 16:
+				stream.state = m_fast_dfa16.get_initial_state();
+				break;
+			default:
+				stream.state = m_fast_dfa32.get_initial_state();
+				break;
+		}
+	}
+
+	virtual bool feed(
+		globmatch_stream &stream, const char *buffer, size_t size) const
+	{
+		if (m_backward)
+			return dfa_matcher_i::feed(stream, buffer, size);
+		if (stream.result >= 0)
+			return true;
+
+		switch (m_state_bits) {
+			case 8:
+				return feed_dfa(m_fast_dfa8, stream, buffer, size);
+			case 16:
+				return feed_dfa(m_fast_dfa16, stream, buffer, size);
+			default:
+				return feed_dfa(m_fast_dfa32, stream, buffer, size);
+		}
+	}
+
+	virtual int end(globmatch_stream &stream) const
+	{
+		if (m_backward)
+			return dfa_matcher_i::end(stream);
+		if (stream.result >= 0)
+			return stream.result;
+
+		switch (m_state_bits) {
+			case 8:
+				return accept(m_fast_dfa8, stream.state);
+			case 16:
+				return accept(m_fast_dfa16, stream.state);
+			default:
+				return accept(m_fast_dfa32, stream.state);
+		}
+	}
+
+	virtual const vector_uint &get_pattern_ids(int match_result) const
+	{
+		static const vector_uint empty;
+		if (match_result <= 0 || (size_t) match_result > m_pattern_id_sets.size())
+			return empty;
+		return m_pattern_id_sets[match_result - 1];
+	}
+
+	virtual const char *skip(const char *buffer, const char *end) const
+	{
+		const char *found;
+
+		// memmem(3) is vectorized by libc.
+		// Lines without literal are matched if inverted.
+		if (m_skip_literal.empty() || m_invert)
+			return buffer;
+		else if (m_ignore_case)
+			found = find_literal_ignore_case(buffer, end, m_skip_literal);
+		else
+			found = (const char *) memmem(
+				buffer, end - buffer,
+				m_skip_literal.data(), m_skip_literal.size());
+
+		if (!found)
+			return end;
+
+		// the beginning of line containing literal
+		while (found > buffer && found[-1] != '\n')
+			--found;
+		return found;
+	}
+};
+
+
+// States of lazy DFA built by one thread. Sets of NFA states are
+// interned as DFA states, arcs are computed on first use.
+struct lazy_dfa_cache {
+	uint64_t owner = 0; // id of lazy_dfa_matcher, 0 means none
+	state_set2id sets;
+	std::vector<uint32_t> arcs; // state * iw_count + iw -> state
+	std::vector<char> finite;
+	size_t memory = 0;          // estimated size in bytes
+};
+
+// Class for matching with DFA built lazily while scanning input.
+// Only DFA states actually visited are built, so patterns
+// with exponential DFA (e.g., *a?????????????????? or large -Wi sets)
+// start matching immediately and use bounded memory.
+// Every thread has its own cache of DFA states, so match() is
+// thread-safe. The cache is flushed when it exceeds memory budget.
+// A thread keeps the cache of the last used lazy matcher only.
+class lazy_dfa_matcher: public dfa_matcher_iwmap_base {
+private:
+	// arcs of lazy_dfa_cache
+	static const uint32_t unknown_state = (uint32_t)-1;
+	static const uint32_t dead_state = (uint32_t)-2;
+
+	// NFA: successors of state for input weight iw are
+	// m_succ[m_succ_first[state * iw_count + iw] .. m_succ_first[... + 1])
+	unsigned m_iw_count = 0;
+	std::vector<unsigned> m_succ_first;
+	std::vector<unsigned> m_succ;
+	vector_uint m_initial_set;
+	std::vector<int> m_fsa_num; // original FSA of finite NFA state or -1
+	unsigned m_fsa_count = 0;
+	accept_func m_is_finite;
+	bool m_empty_set_finite = false;
+
+	size_t m_cache_size;
+	uint64_t m_id;
+
+	static std::atomic<uint64_t> m_last_id;
+	static thread_local lazy_dfa_cache m_cache;
+
+	// Interns set of NFA states as DFA state
+	unsigned add_state(lazy_dfa_cache &cache, vector_uint &&set) const
+	{
+		unsigned count = cache.sets.size();
+		size_t set_size = set.size();
+		unsigned state = cache.sets.add(std::move(set));
+		if (state < count)
+			return state;
+
+		const vector_uint &nfa_states = cache.sets.get(state);
+		std::vector<bool> seen(m_fsa_count);
+		for (unsigned nfa_state: nfa_states) {
+			if (m_fsa_num[nfa_state] >= 0)
+				seen[m_fsa_num[nfa_state]] = true;
+		}
+
+		cache.arcs.resize(cache.arcs.size() + m_iw_count, (uint32_t) unknown_state);
+		cache.finite.push_back(m_is_finite(seen));
+		// set is stored twice: in hash table and as its key
+		cache.memory += (m_iw_count + 2 * set_size + 16) * sizeof(uint32_t);
+		return state;
+	}
+
+	void flush(lazy_dfa_cache &cache) const
+	{
+		cache.sets.clear();
+		cache.arcs.clear();
+		cache.finite.clear();
+		cache.memory = 0;
+
+		// initial state is always 0
+		add_state(cache, vector_uint(m_initial_set));
+	}
+
+	// Computes arc of DFA, flushes cache if it is full.
+	// Numbers of DFA states are not valid after flush.
+	unsigned build_arc(lazy_dfa_cache &cache, unsigned state, unsigned iw) const
+	{
+		vector_uint to_set;
+		for (unsigned nfa_state: cache.sets.get(state)) {
+			unsigned idx = nfa_state * m_iw_count + iw;
+			to_set.insert(to_set.end(),
+				m_succ.begin() + m_succ_first[idx],
+				m_succ.begin() + m_succ_first[idx + 1]);
+		}
+		std::sort(to_set.begin(), to_set.end());
+		to_set.erase(std::unique(to_set.begin(), to_set.end()), to_set.end());
+
+		if (to_set.empty() && !m_empty_set_finite) {
+			cache.arcs[state * m_iw_count + iw] = dead_state;
+			return dead_state;
+		}
+
+		bool flushed = (cache.memory > m_cache_size);
+		if (flushed)
+			flush(cache);
+
+		unsigned to = add_state(cache, std::move(to_set));
+		if (!flushed)
+			cache.arcs[state * m_iw_count + iw] = to;
+		return to;
+	}
+
+public:
+	lazy_dfa_matcher(size_t cache_size) : m_cache_size(cache_size)
+	{
+		m_id = ++m_last_id;
+	}
+
+	virtual void set_nfa(const fsa& nfa)
+	{
+		std::map<unsigned, unsigned> finite_state2fsa_num;
+		set_nfa(nfa, finite_state2fsa_num, 1, operation_accept(UNION));
+	}
+
+	// The same as nfa2dfa() but lazy
+	void set_nfa(
+		const fsa& nfa,
+		const std::map<unsigned, unsigned> &finite_state2fsa_num,
+		unsigned original_fsa_count,
+		const accept_func &is_finite)
+	{
+		fsa nfa_iwmap;
+		build_iw_map(nfa_iwmap, nfa);
+
+		m_iw_count = 0;
+		for (unsigned i = 0; i < m_iw_map_size; ++i) {
+			if (m_iw_map[i] >= m_iw_count)
+				m_iw_count = m_iw_map[i] + 1;
+		}
+
+		unsigned state_count = nfa_iwmap.get_state_count();
+		std::vector<vector_uint> succ(state_count * m_iw_count);
+		for (unsigned from = 0; from < state_count; ++from) {
+			for (const iw_to& arc: nfa_iwmap.get_arcs(from))
+				succ[from * m_iw_count + arc.iw].push_back(arc.to);
+		}
+
+		m_succ.clear();
+		m_succ_first.assign(1, 0);
+		for (const vector_uint &to_states: succ) {
+			m_succ.insert(m_succ.end(), to_states.begin(), to_states.end());
+			m_succ_first.push_back(m_succ.size());
+		}
+
+		const set_uint &initial_states = nfa_iwmap.get_initial_states();
+		m_initial_set.assign(initial_states.begin(), initial_states.end());
+
+		m_fsa_num.assign(state_count, -1);
+		for (unsigned state: nfa_iwmap.get_finite_states()) {
+			auto found = finite_state2fsa_num.find(state);
+			m_fsa_num[state] = (found == finite_state2fsa_num.end() ? 0 : found->second);
+		}
+		m_fsa_count = original_fsa_count;
+		m_is_finite = is_finite;
+		m_empty_set_finite = is_finite(std::vector<bool>(original_fsa_count));
+
+		// states of previous NFA are not valid anymore
+		m_id = ++m_last_id;
+	}
+
+	virtual int match(const char *buffer, size_t buffer_size) const
+	{
+		lazy_dfa_cache &cache = m_cache;
+		if (cache.owner != m_id) {
+			cache.owner = m_id;
+			flush(cache);
+		}
+
+		unsigned state = 0;
+		for (size_t pos = 0; pos < buffer_size; ++pos) {
+			unsigned iw = m_iw_map[(unsigned char) buffer[pos]];
+			unsigned next = cache.arcs[state * m_iw_count + iw];
+			if (next == unknown_state)
+				next = build_arc(cache, state, iw);
+			if (next == dead_state)
+				return 0;
+			state = next;
+		}
+
+		return cache.finite[state];
+	}
+
+	virtual const vector_uint &get_pattern_ids(int) const
+	{
+		static const vector_uint empty;
+		return empty;
+	}
+};
+
+std::atomic<uint64_t> lazy_dfa_matcher::m_last_id;
+thread_local lazy_dfa_cache lazy_dfa_matcher::m_cache;
+
+// Name of compiled DFA cache file for the given key
+static std::string cache_filename(const char *cache_dir, const std::string &key)
+{
+	// FNV-1a
+	uint64_t h = 14695981039346656037ULL;
+	for (unsigned char c: key) {
+		h ^= c;
+		h *= 1099511628211ULL;
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.dfa", (unsigned long long) h);
+
+	std::string ret = cache_dir;
+	if (ret.empty() || ret.back() != '/')
+		ret += '/';
+	return ret + name;
+}
+
+// Lazy DFA is built from union of pattern NFAs, the operation
+// is applied while building DFA states
+static std::unique_ptr<const globmatch> compile_lazy(
+	const std::vector<fsa> &nfas, const globmatch_options &options,
+	const bool_expr &expr)
+{
+	std::map<unsigned, unsigned> finite_state2fsa_num;
+	fsa nfa;
+	copy_nfas(nfa, finite_state2fsa_num, nfas);
+	for (std::pair<unsigned, unsigned> p: finite_state2fsa_num) {
+		nfa.add_finite_state(p.first);
+	}
+
+	accept_func is_finite;
+	switch (options.operation) {
+		case GLOBMATCH_UNION:
+			is_finite = operation_accept(UNION);
+			break;
+		case GLOBMATCH_INTERSECT:
+			is_finite = operation_accept(INTERSECT);
+			break;
+		case GLOBMATCH_SUBTRACT:
+			is_finite = operation_accept(SUBTRACT);
+			break;
+		case GLOBMATCH_EXPRESSION:
+			is_finite = [expr](const std::vector<bool> &seen) { return expr.eval(seen); };
+			break;
+		default:
+			abort();
+	}
+	if (options.invert) {
+		is_finite = [is_finite](const std::vector<bool> &seen) {
+			return !is_finite(seen);
+		};
+	}
+
+	std::unique_ptr<lazy_dfa_matcher> matcher(
+		new lazy_dfa_matcher(options.lazy_cache_size));
+	matcher->set_ignore_case(options.ignore_case);
+	matcher->set_nfa(nfa, finite_state2fsa_num, nfas.size(), is_finite);
+	return matcher;
+}
+
+std::unique_ptr<const globmatch> globmatch_compile(
+	const std::vector<std::string> &globs, const globmatch_options &options,
+	std::string *error)
+{
+	bool pattern_ids = options.pattern_ids && !options.invert;
+	bool lazy = options.lazy && !pattern_ids;
+
+	std::unique_ptr<dfa_matcher_iwmap<fast_dfa_shift>> matcher(
+		new dfa_matcher_iwmap<fast_dfa_shift>);
+	matcher->set_minimization(
+		options.minimization == GLOBMATCH_BRZOZOWSKI ? BRZOZOWSKI : HOPCROFT);
+	matcher->set_invert(options.invert);
+	matcher->set_ignore_case(options.ignore_case);
+	matcher->set_stride(options.stride);
+
+	// find() reports exact spans for union of unanchored patterns,
+	// DFA finding their beginnings is not cached
+	bool spans = (options.unanchored && !options.invert &&
+		options.operation == GLOBMATCH_UNION);
+
+	// Everything DFA depends on
+	std::string cache_key;
+	std::string cache_file;
+	bool loaded = false;
+	if (options.cache_dir && !lazy) {
+		cache_key += (char) ('0' + options.operation);
+		cache_key += (char) ('0' + options.minimization);
+		cache_key += (char) ('0' + pattern_ids);
+		cache_key += (char) ('0' + options.invert);
+		cache_key += (char) ('0' + options.ignore_case);
+		cache_key += (char) ('0' + options.unanchored);
+		for (const std::string &glob: globs) {
+			cache_key += glob;
+			cache_key += '\0';
+		}
+		cache_file = cache_filename(options.cache_dir, cache_key);
+
+		if (matcher->load(cache_file.c_str(), cache_key)) {
+			if (options.train_size > 0)
+				matcher->train(options.train_data, options.train_size);
+			if (!spans)
+				return matcher;
+			loaded = true;
+		}
+	}
+
+	bool_expr expr;
+	if (options.operation == GLOBMATCH_EXPRESSION) {
+		std::string expr_text;
+		for (const std::string &glob: globs) {
+			if (!expr_text.empty())
+				expr_text += ' ';
+			expr_text += glob;
+		}
+
+		std::string expr_error;
+		if (!expr.parse(expr_text, expr_error)) {
+			if (error)
+				*error = expr_error;
+			return nullptr;
+		}
+	}
+
+	const std::vector<std::string> &nfa_globs =
+		(options.operation == GLOBMATCH_EXPRESSION ? expr.get_globs() : globs);
+	std::vector<fsa> nfas;
+	nfas.resize(nfa_globs.size());
+	for (unsigned i = 0; i < nfa_globs.size(); ++i) {
+		std::string glob_error;
+		if (!parse_glob(nfas[i], nfa_globs[i].c_str(),
+			options.ignore_case, glob_error)) {
+			if (error)
+				*error = nfa_globs[i] + ": " + glob_error;
+			return nullptr;
+		}
+	}
+
+	fsa span_nfa;
+	if (spans && !lazy)
+		union_nfa(span_nfa, nfas);
+	if (options.unanchored) {
+		for (fsa &nfa: nfas)
+			unanchor_nfa(nfa);
+	}
+
+	if (lazy)
+		return compile_lazy(nfas, options, expr);
+
+	if (loaded) {
+		matcher->set_span_nfa(span_nfa);
+		return matcher;
+	}
+
+	fsa nfa;
+	switch (options.operation) {
+		case GLOBMATCH_UNION:
+			union_nfa(nfa, nfas, pattern_ids);
+			break;
+		case GLOBMATCH_INTERSECT:
+			intersect_nfa(nfa, nfas);
+			break;
+		case GLOBMATCH_SUBTRACT:
+			subtract_nfa(nfa, nfas);
+			break;
+		case GLOBMATCH_EXPRESSION:
+			expression_nfa(nfa, nfas, expr);
+			break;
+		default:
+			abort();
+	}
+
+	//	print_fsa(nfa);
+
+	matcher->set_nfa(nfa);
+	if (options.train_size > 0)
+		matcher->train(options.train_data, options.train_size);
+	if (spans)
+		matcher->set_span_nfa(span_nfa);
+
+	// Failure to write cache is not fatal, DFA is just built next time
+	if (options.cache_dir)
+		matcher->save(cache_file.c_str(), cache_key);
+
+	return matcher;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2024 Aleksey Cheusov <vle@gmx.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _GLOBMATCH_H_
+#define _GLOBMATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// How several glob patterns are combined into one matcher
+enum globmatch_operation {
+	GLOBMATCH_UNION,     // line matches at least one pattern
+	GLOBMATCH_INTERSECT, // line matches all patterns
+	GLOBMATCH_SUBTRACT,  // line matches the first pattern but no others
+	// Patterns joined with spaces form boolean expression like
+	// (a* & *b) | !*tmp* where ! is negation, & is conjunction and
+	// | is disjunction.  Globs in expression cannot contain spaces
+	// and ()&|! characters outside of [...] unless escaped by '\'.
+	GLOBMATCH_EXPRESSION,
+};
+
+// Algorithm used for DFA minimization
+enum globmatch_minimization {
+	GLOBMATCH_BRZOZOWSKI,
+	GLOBMATCH_HOPCROFT,
+};
+
+struct globmatch_options {
+	globmatch_operation operation = GLOBMATCH_UNION;
+	globmatch_minimization minimization = GLOBMATCH_HOPCROFT;
+	// Directory for caching compiled DFA, nullptr disables the cache
+	const char *cache_dir = nullptr;
+	// Track which patterns matched the line, GLOBMATCH_UNION only.
+	// DFA may have more states than without it.
+	bool pattern_ids = false;
+	// Build DFA states lazily while matching instead of building
+	// minimal DFA in advance.  It is useful if DFA is huge.
+	// DFA is neither minimized nor cached, no prefilter is used.
+	// Ignored if pattern_ids is set.
+	bool lazy = false;
+	// Memory budget in bytes of per-thread cache of lazy DFA states
+	size_t lazy_cache_size = 8 << 20;
+	// Match lines that do NOT match patterns. The complement is
+	// taken on DFA, so inverted matching is as fast as regular one.
+	// pattern_ids is ignored.
+	bool invert = false;
+	// Match ASCII letters regardless of case. Both cases of a letter
+	// share a column of DFA matrix, so matching is as fast as
+	// case-sensitive one. Letters are folded in literal prefilter
+	// and in skipping of self-looping states too.
+	bool ignore_case = false;
+	// Patterns match any part of line instead of the whole line, e.g.,
+	// foo? works like *foo?*. DFA stops as soon as the first match
+	// ends, see globmatch::find().
+	bool unanchored = false;
+	// Sample of input used for laying out DFA states so that
+	// frequently visited ones are adjacent in memory. It is only
+	// read by globmatch_compile(). Ignored by lazy DFA.
+	const char *train_data = nullptr;
+	size_t train_size = 0;
+	// The number of bytes (1, 2 or 4) consumed by one DFA step. Larger
+	// stride shortens chain of dependent loads but needs matrix of arcs
+	// growing as (number of byte classes)^stride, smaller stride is
+	// used if it does not fit 1MiB. Ignored with pattern_ids.
+	unsigned stride = 1;
+};
+
+// The number of lines matched simultaneously by match_batch(),
+// larger batches are split.
+#define GLOBMATCH_BATCH_SIZE 8
+
+// Line matched by parts with globmatch::feed()
+struct globmatch_stream {
+	uint32_t state = 0; // DFA state after the parts fed so far
+	int result = -1;    // match result if it is known before the end of line
+	std::string line;   // parts collected by matchers that cannot resume DFA
+};
+
+// Compiled glob patterns. The object is immutable, so all methods
+// are safe to call from several threads simultaneously.
+class globmatch {
+public:
+	virtual ~globmatch() {}
+
+	// Returns non-zero if line [buffer, buffer+buffer_size) matches.
+	// Line should not contain '\n'. With pattern_ids option the
+	// result identifies set of matched patterns, see get_pattern_ids().
+	virtual int match(const char *buffer, size_t buffer_size) const = 0;
+
+	// Matches count independent lines and stores results to results[]
+	virtual void match_batch(
+		const char *const *buffers, const size_t *buffer_sizes,
+		int *results, size_t count) const = 0;
+
+	// Returns the beginning of the first line in [buffer, end) that
+	// may be matched, or end. Lines before it cannot be matched.
+	virtual const char *skip(const char *buffer, const char *end) const = 0;
+
+	// The same as match() but [*begin, *end) is set to offsets of the
+	// matched part of line. For union of unanchored patterns (neither
+	// inverted nor lazy) it is the match that ends first, the longest
+	// of them, and pattern IDs are the ones matching this part,
+	// otherwise it is the whole line.
+	virtual int find(
+		const char *buffer, size_t buffer_size,
+		size_t *begin, size_t *end) const = 0;
+
+	// Line may be matched by parts, e.g., while it is being read:
+	// begin() starts line, feed() passes its next part and end()
+	// returns the same as match() for the whole line. feed() returns
+	// true if the result is already known, the rest of line may be
+	// skipped then. DFA state is carried between parts, so they are
+	// neither copied nor scanned again, except for lazy DFA and DFA
+	// scanning lines backward that collect line in stream.line.
+	virtual void begin(globmatch_stream &stream) const = 0;
+	virtual bool feed(
+		globmatch_stream &stream, const char *buffer, size_t size) const = 0;
+	virtual int end(globmatch_stream &stream) const = 0;
+
+	// Returns sorted indexes (in globs passed to globmatch_compile) of
+	// patterns matched by line for which match() returned match_result.
+	// Empty unless pattern_ids option is set.
+	virtual const std::vector<unsigned> &get_pattern_ids(int match_result) const = 0;
+};
+
+// Compiles glob patterns to matcher. In glob patterns '*' means
+// any sequence of bytes, '?' means any byte, [a-z0-9], [!a-z] or
+// [^a-z] and [[:digit:]] mean byte from (not from) the set and
+// '\' escapes the next character.  Unterminated '[' is literal.
+// Returns nullptr and sets *error (if error is not nullptr) if
+// patterns are invalid.
+std::unique_ptr<const globmatch> globmatch_compile(
+	const std::vector<std::string> &globs,
+	const globmatch_options &options = globmatch_options(),
+	std::string *error = nullptr);
+
+#endif
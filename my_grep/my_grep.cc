@@ -21,12 +21,8 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
-// Algorithm:
-// * Convert glob pattern to NFA.
-// * Map input weights of NFA (ASCII characters) to positive numbers,
-//   unseen character in this map is mapped to 0.
-// * Convert NFA to MinDFA using Brzozoeski algorithm.
-// * Match using MinDFA.
+// grep-like utility on top of libglobmatch: input is split into lines
+// that are matched by compiled glob patterns in one or several threads.
 
 #include <cstdio>
 #include <cstdlib>
@@ -35,812 +31,838 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <vector>
-#include <set>
-#include <map>
 #include <algorithm>
-#include <iostream>
-#include <utility>
+#include <string>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include <mkc_err.h>
 
 #include "file_match.h"
+#include "globmatch.h"
 
-static std::ostream &debug = std::cerr;
+static const globmatch *matcher;
 
-struct iw_to {
-	unsigned iw = 0; // input weight
-	unsigned to = 0; // destination state
+// prefix of output lines, e.g., "filename:"
+static std::string line_prefix;
 
-	iw_to () {}
-	iw_to (unsigned iw, unsigned to) {
-		this->iw = iw;
-		this->to = to;
-	}
-};
+// prefix output with filename
+static bool with_filename = false;
 
-typedef std::vector<unsigned> vector_uint;
-typedef std::vector<iw_to> vector_iwto;
-typedef std::set<unsigned> set_uint;
+// output IDs of matched patterns before line
+static bool print_pattern_ids = false;
 
-enum fsa_operation {
-	UNION,
-	INTERSECT,
-	SUBTRACT,
-	NEGATE,
-};
+// output matched part of line instead of the whole line (-o)
+static bool only_matching = false;
 
-static uint32_t nextpow2(uint32_t value)
-{
-	uint32_t ret = value;
-	ret |= ret >> 1;
-	ret |= ret >> 2;
-	ret |= ret >> 4;
-	ret |= ret >> 16;
-	return ret + 1;
-}
-
-class set_uint2id {
-private:
-	unsigned m_count = 0;
-	std::map<set_uint, unsigned> m_map;
-public:
-	set_uint2id() {}
-
-	// Returns id of inserted item, i.e., 0, 1, 2, etc.
-	unsigned add(set_uint v) {
-		std::map<set_uint, unsigned>::const_iterator found = m_map.find(v);
-		if (found == m_map.end()) {
-			m_map[v] = m_count;
-			return m_count++;
-		} else {
-			return found->second;
-		}
-	}
+// What is output for every input
+enum output_mode {
+	OUTPUT_LINES, // matched lines
+	OUTPUT_COUNT, // number of matched lines (-c)
+	OUTPUT_FILES, // names of inputs with matched lines (-l)
+	OUTPUT_QUIET, // nothing, exit status only (-q)
 };
 
-// Finite State Automaton used for building NFA and DFA.
-// It is slow but it does not matter for this test ;-)
-class fsa {
-private:
-	unsigned m_state_count = 0;
-	set_uint m_initial_states;
-	set_uint m_finite_states;
-	set_uint m_iws;
-	std::vector<vector_iwto> m_outgoing_arcs;
+static output_mode mode = OUTPUT_LINES;
 
-	static const vector_iwto m_empty_iwto;
+// maximum number of matched lines per input (-m)
+static size_t max_count = (size_t)-1;
 
-public:
-	fsa() {}
+// true if at least one line matched, it is the exit status
+static bool matched_any = false;
+static bool input_error = false; // some FILE is skipped, exit status is 2
 
-	~fsa() {
-		clear();
-	}
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-	void clear()
-	{
-		m_state_count = 0;
-		m_initial_states.clear();
-		m_finite_states.clear();
-		m_iws.clear();
-		m_outgoing_arcs.clear();
-	}
+// Output collected as slices that are written by writev(2).
+// Runs of adjacent matched lines are referenced right in the input
+// buffer as a single slice, so input must stay valid until flush().
+// Separate short lines and small pieces like prefixes are copied,
+// because writing many tiny slices is slower than copying them.
+// Every thread fills its own buffers, only flush() writes to descriptor.
+class output_buffer {
+private:
+	static const size_t min_reference_size = 256;
 
-	inline unsigned get_state_count() const {
-		return m_state_count;
-	}
+	struct slice {
+		const char *data; // nullptr means m_copied + offset
+		size_t offset;
+		size_t size;
+	};
 
-	inline const set_uint& get_initial_states() const {
-		return m_initial_states;
-	}
+	std::vector<slice> m_slices;
+	std::string m_copied;
+	std::vector<struct iovec> m_iov;
 
-	inline const set_uint& get_finite_states() const {
-		return m_finite_states;
-	}
+	// input copied to the end of m_copied by the last append()
+	const char *m_pending = nullptr;
+	size_t m_pending_size = 0;
 
-	inline const set_uint& get_iws() const {
-		return m_iws;
+	const char *slice_data(const slice &s) const
+	{
+		return s.data ? s.data : m_copied.data() + s.offset;
 	}
 
-	inline const vector_iwto& get_arcs(unsigned state) const {
-		if (state < get_state_count())
-			return m_outgoing_arcs[state];
-		else
-			return m_empty_iwto;
-	}
+	static void write_iov(int fd, struct iovec *iov, int count)
+	{
+		while (count > 0) {
+			ssize_t ret = writev(fd, iov, count);
+			if (ret == -1) {
+				if (errno == EINTR)
+					continue;
+				err(1, "write error");
+			}
 
-	vector_uint get_arcs(unsigned state, unsigned iw) const {
-		vector_uint ret;
-		const vector_iwto& outgoing_arcs = m_outgoing_arcs[state];
-		for (unsigned i = 0; i < outgoing_arcs.size(); ++i) {
-			const iw_to& arc = outgoing_arcs[i];
-			if (arc.iw == iw)
-				ret.push_back(arc.to);
+			// skip what is written
+			size_t written = ret;
+			while (count > 0 && written >= iov->iov_len) {
+				written -= iov->iov_len;
+				++iov;
+				--count;
+			}
+			if (count > 0) {
+				iov->iov_base = (char *) iov->iov_base + written;
+				iov->iov_len -= written;
+			}
 		}
-		return ret;
 	}
 
 public:
-	void add_finite_state(unsigned state) {
-		update_state_count(state);
-		m_finite_states.insert(state);
+	bool empty() const
+	{
+		return m_slices.empty();
 	}
 
-	void add_initial_state(unsigned state) {
-		update_state_count(state);
-		m_initial_states.insert(state);
-	}
+	// Adds data from input, it is either referenced or copied
+	void append(const char *data, size_t size)
+	{
+		if (!m_slices.empty()) {
+			slice &last = m_slices.back();
+			if (last.data && last.data + last.size == data) {
+				last.size += size;
+				return;
+			}
+		}
 
-	void add_iw(unsigned iw) {
-		m_iws.insert(iw);
+		// copied run of input is continued
+		bool continued = (m_pending_size > 0 && m_pending + m_pending_size == data);
+		if (continued && m_pending_size + size >= min_reference_size) {
+			// long enough, it is referenced instead
+			slice &last = m_slices.back();
+			m_copied.resize(m_copied.size() - m_pending_size);
+			last.size -= m_pending_size;
+			if (last.size == 0)
+				m_slices.pop_back();
+			m_slices.push_back(slice{m_pending, 0, m_pending_size + size});
+			m_pending_size = 0;
+		} else if (continued) {
+			size_t pending_size = m_pending_size + size;
+			copy(data, size);
+			m_pending_size = pending_size;
+		} else if (size < min_reference_size) {
+			copy(data, size);
+			m_pending = data;
+			m_pending_size = size;
+		} else {
+			m_slices.push_back(slice{data, 0, size});
+		}
 	}
 
-	void add_arc(unsigned from, unsigned iw, unsigned to) {
-		update_state_count(from);
-		update_state_count(to);
-		add_iw(iw);
-
-		vector_iwto &outgoing_arcs = m_outgoing_arcs[from];
-		for (unsigned i = 0; i < outgoing_arcs.size(); ++i) {
-			iw_to &arc = outgoing_arcs[i];
-			if (arc.iw == iw && arc.to == to)
+	// Adds copy of data
+	void copy(const char *data, size_t size)
+	{
+		m_pending_size = 0;
+		if (!m_slices.empty()) {
+			slice &last = m_slices.back();
+			if (!last.data && last.offset + last.size == m_copied.size()) {
+				last.size += size;
+				m_copied.append(data, size);
 				return;
+			}
 		}
-		outgoing_arcs.push_back(iw_to(iw, to));
+		m_slices.push_back(slice{nullptr, m_copied.size(), size});
+		m_copied.append(data, size);
 	}
 
-	bool is_finite_state(unsigned state) const {
-		return m_finite_states.find(state) != m_finite_states.end();
+	void copy(const std::string &str)
+	{
+		copy(str.data(), str.size());
 	}
 
-private:
-	void update_state_count(unsigned state){
-		if (state < m_state_count)
-			return;
-
-		m_state_count = state + 1;
-		while (m_outgoing_arcs.size() < m_state_count) {
-			m_outgoing_arcs.resize(m_outgoing_arcs.size() + 1);
+	// Leaves the first line_count lines only
+	void truncate_lines(size_t line_count)
+	{
+		m_pending_size = 0;
+		for (size_t i = 0; i < m_slices.size(); ++i) {
+			const char *data = slice_data(m_slices[i]);
+			const char *end = data + m_slices[i].size;
+			const char *eol = data;
+			while (line_count > 0 &&
+				(eol = (const char *) memchr(eol, '\n', end - eol)) != nullptr)
+			{
+				++eol;
+				--line_count;
+			}
+			if (line_count == 0) {
+				m_slices[i].size = eol - data;
+				m_slices.resize(i + 1);
+				return;
+			}
 		}
 	}
-};
-
-const vector_iwto fsa::m_empty_iwto;
-
-// In order to reduce memory consumption for storing matrix of arcs,
-// we map characters seen in glob pattern to positive numbers 1, 2, 3 etc.
-// For example, we map 'A' to 1, 'B' to 2 etc.
-// Returned value is an allocated and filled IW map array.
-static unsigned *build_iwmap(fsa& dst_fsa, unsigned iw_map_size, const fsa& src_fsa)
-{
-	// build iw_map
-	const set_uint& iws = src_fsa.get_iws();
 
-	unsigned iw_count = 0;
-	for (unsigned iw: iws) {
-		if (iw >= iw_count)
-			iw_count = iw + 1;
+	void clear()
+	{
+		m_slices.clear();
+		m_copied.clear();
+		m_pending_size = 0;
 	}
-	assert(iw_count <= iw_map_size);
 
-	unsigned *iw_map = new unsigned[iw_map_size];
-	// iw == 0 means all possible ASCII characters except seen in glob pattern
-	memset(iw_map, 0, iw_map_size * sizeof(iw_map[0]));
-
-	unsigned max_new_iw = 0;
-	for (unsigned iw: iws) {
-		if (iw != 0 && !iw_map[iw]){ // map 0 to 0
-			iw_map[iw] = ++max_new_iw; // others non-0 to positive numbers
+	// Copies referenced input, so that input may be released
+	// before flush()
+	void detach()
+	{
+		std::string copied;
+		for (const slice &s: m_slices)
+			copied.append(slice_data(s), s.size);
+		clear();
+		if (!copied.empty()) {
+			m_copied.swap(copied);
+			m_slices.push_back(slice{nullptr, 0, m_copied.size()});
 		}
 	}
 
-	// build dst_fsa
-	const set_uint& initial_states = src_fsa.get_initial_states();
-	for (unsigned state: initial_states)
-		dst_fsa.add_initial_state(state);
+	// Writes output to fd and clears it
+	void flush(int fd)
+	{
+		if (m_slices.empty())
+			return;
 
-	const set_uint& finite_states = src_fsa.get_finite_states();
-	for (unsigned state: finite_states)
-		dst_fsa.add_finite_state(state);
+		// preceding output may be buffered by stdio
+		if (fd == STDOUT_FILENO)
+			fflush(stdout);
 
-	for (unsigned from = 0; from < src_fsa.get_state_count(); ++from) {
-		const vector_iwto& outgoing_arcs = src_fsa.get_arcs(from);
-		for (unsigned i = 0; i < outgoing_arcs.size(); ++i) {
-			unsigned iw = outgoing_arcs[i].iw;
-			unsigned to = outgoing_arcs[i].to;
-			dst_fsa.add_arc(from, iw_map[iw], to);
+		m_iov.clear();
+		for (const slice &s: m_slices) {
+			m_iov.push_back(iovec{(void *) slice_data(s), s.size});
+			if (m_iov.size() == IOV_MAX) {
+				write_iov(fd, m_iov.data(), m_iov.size());
+				m_iov.clear();
+			}
 		}
+		write_iov(fd, m_iov.data(), m_iov.size());
+		clear();
 	}
+};
 
-	return iw_map;
-}
+// Result of matching input or a part of it
+struct match_context {
+	output_buffer output; // matched lines, OUTPUT_LINES mode only
+	size_t count = 0;   // number of matched lines
+	size_t limit = (size_t)-1; // matching stops after limit lines
+	int error = 0;      // errno if input cannot be read
+};
 
-// Inverts FSA, that is, inverts all arcs, make initial states finite and vice versa.
-static void invert(fsa& dst_fsa, const fsa& src_fsa)
+// The number of matched lines after which the answer is known
+static size_t input_limit()
 {
-	dst_fsa.clear();
-
-	for (unsigned iw: src_fsa.get_iws())
-		dst_fsa.add_iw(iw);
-
-	for (unsigned state: src_fsa.get_initial_states())
-		dst_fsa.add_finite_state(state);
+	if (mode == OUTPUT_FILES || mode == OUTPUT_QUIET)
+		return 1;
+	return max_count;
+}
 
-	for (unsigned state: src_fsa.get_finite_states())
-		dst_fsa.add_initial_state(state);
+// Called on every matched line. With -q the answer is known,
+// other inputs are not scanned and output buffers are not flushed.
+static inline void line_matched(match_context &ctx)
+{
+	++ctx.count;
+	if (mode == OUTPUT_QUIET)
+		_exit(0);
+}
 
-	std::size_t state_count = src_fsa.get_state_count();
-	for (unsigned from = 0; from < state_count; ++from) {
-		for (const iw_to& iwto: src_fsa.get_arcs(from)) {
-			unsigned iw = iwto.iw;
-			unsigned to = iwto.to;
-			dst_fsa.add_arc(to, iw, from);
+// Appends prefix and pattern IDs of output line
+static inline void output_prefix(
+	output_buffer &output, const std::string &prefix, int match_result)
+{
+	if (!prefix.empty())
+		output.copy(prefix);
+	if (print_pattern_ids) {
+		static thread_local std::string ids;
+		const char *sep = "";
+		ids.clear();
+		for (unsigned id: matcher->get_pattern_ids(match_result)) {
+			ids += sep;
+			ids += std::to_string(id);
+			sep = ",";
 		}
+		ids += ':';
+		output.copy(ids);
 	}
 }
 
-// Convert Non-deterministic FSA to Deterministic FSA
-// https://en.m.wikipedia.org/wiki/Powerset_construction
-static void nfa2dfa(
-	fsa& dfa,
-	const fsa &nfa,
-	const std::map<unsigned, unsigned> finite_state2fsa_num,
-	fsa_operation operation)
+// Appends matched line to output. The line is referenced in input
+// buffer [..., end) together with its newline if any.
+static inline void output_line(
+	output_buffer &output, const std::string &prefix,
+	const char *line, size_t line_len, const char *end, int match_result)
 {
-	dfa.clear();
-
-	for (unsigned iw: nfa.get_iws())
-		dfa.add_iw(iw);
-
-	std::vector<set_uint> state_set_stack;
-	const set_uint &initial_states = nfa.get_initial_states();
-	if (!initial_states.empty()) {
-		state_set_stack.push_back(initial_states);
-		dfa.add_initial_state(0);
-	}
-
-	unsigned original_fsa_count = 0;
-	for (std::pair<unsigned, unsigned> p: finite_state2fsa_num) {
-		if (p.second > original_fsa_count)
-			original_fsa_count = p.second;
-	}
-	++original_fsa_count;
-	//debug << "original_fsa_count:" << original_fsa_count << '\n';
-
-	const set_uint& iws = nfa.get_iws();
-
-	set_uint2id set2id;
-
-	while (!state_set_stack.empty()) {
-		set_uint from_set(state_set_stack.back());
-		state_set_stack.pop_back();
-
-		unsigned dfa_from = set2id.add(from_set);
-
-		switch (operation) {
-			case UNION:
-				for (unsigned from_state: from_set)
-					if (nfa.is_finite_state(from_state))
-						dfa.add_finite_state(dfa_from);
-				break;
-
-			case INTERSECT:
-				{
-					set_uint fsa_nums;
-					for (unsigned from_state: from_set)
-						if (nfa.is_finite_state(from_state))
-							fsa_nums.insert(finite_state2fsa_num.find(from_state)->second);
-					//debug << "fsa_nums:" << fsa_nums.size() << '\n';
-					if (fsa_nums.size() == original_fsa_count)
-						dfa.add_finite_state(dfa_from);
-				}
-				break;
-
-			case SUBTRACT:
-				{
-					set_uint fsa_nums;
-					for (unsigned from_state: from_set)
-						if (nfa.is_finite_state(from_state))
-							fsa_nums.insert(finite_state2fsa_num.find(from_state)->second);
-					//debug << "fsa_nums:" << fsa_nums.size() << '\n';
-					if (fsa_nums.size() == 1 && *fsa_nums.begin() == 0)
-						dfa.add_finite_state(dfa_from);
-				}
-				break;
-
-			default:
-				abort();
-		}
-
-		for (unsigned iw: iws) {
-			set_uint to_set;
-			for (unsigned from_state: from_set) {
-				for (unsigned to: nfa.get_arcs(from_state, iw))
-					to_set.insert(to);
-			}
-			if (!to_set.empty()) {
-				unsigned dfa_to = set2id.add(to_set);
-				if (dfa_to == dfa.get_state_count())
-					state_set_stack.push_back(to_set);
-				dfa.add_arc(dfa_from, iw, dfa_to);
-			}
-		}
+	output_prefix(output, prefix, match_result);
+	if (line + line_len < end) {
+		output.append(line, line_len + 1);
+	} else {
+		output.append(line, line_len);
+		output.copy("\n", 1);
 	}
 }
 
-static void nfa2dfa(fsa& dfa, const fsa &nfa)
+// Appends matched part of line to output (-o)
+static inline void output_part(
+	output_buffer &output, const std::string &prefix,
+	const char *part, size_t part_len, int match_result)
 {
-	std::map<unsigned, unsigned> empty;
-	nfa2dfa(dfa, nfa, empty, UNION);
+	output_prefix(output, prefix, match_result);
+	output.append(part, part_len);
+	output.copy("\n", 1);
 }
 
-// Convert Non-deterministic FSA to Minimal Deterministic FSA
-// with the help of Brzozowski algorithm.
-// https://en.wikipedia.org/wiki/DFA_minimization
-static void nfa2mindfa(fsa& dfa, const fsa &nfa)
+// Matches lines in buffer until ctx.limit lines are matched.
+// In OUTPUT_LINES mode matched lines are appended to ctx.output,
+// in other modes they are only counted.
+// Lines that cannot be matched are skipped with the help of prefilter.
+static void match_buffer(
+	match_context &ctx, const std::string &prefix,
+	const char *buffer, size_t size)
 {
-	fsa inv;
-	invert(inv, nfa);
-
-	fsa tmp_dfa;
-	nfa2dfa(tmp_dfa, inv);
-
-	inv.clear();
-	invert(inv, tmp_dfa);
-
-	nfa2dfa(dfa, inv);
+	const char *end = buffer + size;
+
+	while (ctx.count < ctx.limit && (buffer = matcher->skip(buffer, end)) < end) {
+		const char *eol = (const char *) memchr(buffer, '\n', end - buffer);
+		size_t line_len = (eol ? eol : end) - buffer;
+		size_t begin, match_end;
+		int result = (only_matching
+			? matcher->find(buffer, line_len, &begin, &match_end)
+			: matcher->match(buffer, line_len));
+		if (result) {
+			line_matched(ctx);
+			if (mode == OUTPUT_LINES && only_matching)
+				output_part(ctx.output, prefix, buffer + begin, match_end - begin, result);
+			else if (mode == OUTPUT_LINES)
+				output_line(ctx.output, prefix, buffer, line_len, end, result);
+		}
+		buffer = (eol ? eol + 1 : end);
+	}
 }
 
-// copy NFAs to single NFA
-static void copy_nfas(
-	fsa& dst,
-	std::map<unsigned, unsigned>& finite_state2fsa_num,
-	const std::vector<fsa> &src)
+// The same as match_buffer but lines are matched by batches
+static void match_buffer_batch(
+	match_context &ctx, const std::string &prefix,
+	const char *buffer, size_t size)
 {
-	dst.clear();
-
-	set_uint common_iws;
-	for (const fsa& nfa: src) {
-		common_iws.insert(nfa.get_iws().begin(), nfa.get_iws().end());
-	}
-
-	unsigned offset = 0;
-	for (size_t fsa_num = 0; fsa_num < src.size(); ++fsa_num) {
-		const fsa& nfa = src[fsa_num];
-
-		for (unsigned state: nfa.get_initial_states())
-			dst.add_initial_state(state + offset);
-
-		for (unsigned state: nfa.get_finite_states())
-			finite_state2fsa_num[state + offset] = fsa_num;
-
-		const set_uint& current_iws = nfa.get_iws();
-
-		set_uint iws_diff;
-		std::set_difference(
-			common_iws.begin(), common_iws.end(),
-			current_iws.begin(), current_iws.end(),
-			std::inserter(iws_diff, iws_diff.begin()));
-
-		size_t state_count = nfa.get_state_count();
-		for (unsigned state = 0; state < state_count; ++state) {
-			for (const iw_to& iwto: nfa.get_arcs(state)) {
-				unsigned iw = iwto.iw;
-				unsigned to = iwto.to;
-				if (iw) {
-					dst.add_arc(state + offset, iw, to + offset);
-				} else {
-					dst.add_arc(state + offset, 0, to + offset);
-					for (unsigned new_iw: iws_diff) {
-						dst.add_arc(state + offset, new_iw, to + offset);
-					}
+	const char *end = buffer + size;
+	const char *lines[GLOBMATCH_BATCH_SIZE];
+	size_t line_lens[GLOBMATCH_BATCH_SIZE];
+	int results[GLOBMATCH_BATCH_SIZE];
+
+	while (ctx.count < ctx.limit && buffer < end) {
+		// collect batch of candidate lines
+		size_t count = 0;
+		while (count < GLOBMATCH_BATCH_SIZE &&
+			(buffer = matcher->skip(buffer, end)) < end)
+		{
+			const char *eol = (const char *) memchr(buffer, '\n', end - buffer);
+			lines[count] = buffer;
+			line_lens[count] = (eol ? eol : end) - buffer;
+			++count;
+			buffer = (eol ? eol + 1 : end);
+		}
+
+		matcher->match_batch(lines, line_lens, results, count);
+
+		for (size_t i = 0; i < count && ctx.count < ctx.limit; ++i) {
+			if (results[i]) {
+				line_matched(ctx);
+				if (mode == OUTPUT_LINES && only_matching) {
+					// matched lines only are searched again
+					size_t begin, match_end;
+					int result = matcher->find(lines[i], line_lens[i], &begin, &match_end);
+					output_part(ctx.output, prefix,
+						lines[i] + begin, match_end - begin, result);
+				} else if (mode == OUTPUT_LINES) {
+					output_line(ctx.output, prefix,
+						lines[i], line_lens[i], end, results[i]);
 				}
 			}
 		}
-
-		offset = dst.get_state_count();
 	}
 }
 
-// Union of several NFA
-static void union_nfa(
-	fsa& dst,
-	const std::vector<fsa> &src)
-{
-	std::map<unsigned, unsigned> finite_state2fsa_num;
-	copy_nfas(dst, finite_state2fsa_num, src);
-	for (std::pair<unsigned, unsigned> p: finite_state2fsa_num) {
-		dst.add_finite_state(p.first);
-	}
-}
+static void (*match_buffer_func)(
+	match_context &ctx, const std::string &prefix,
+	const char *buffer, size_t size) = match_buffer;
 
-// Intersect of several NFA
-static void intersect_nfa(
-	fsa& dst,
-	const std::vector<fsa> &src)
+// Outputs result for the whole input in -c and -l modes
+static void report_input(const std::string &filename, size_t count)
 {
-	std::map<unsigned, unsigned> finite_state2fsa_num;
-	fsa tmp_nfa;
-	copy_nfas(tmp_nfa, finite_state2fsa_num, src);
-	for (std::pair<unsigned, unsigned> p: finite_state2fsa_num) {
-		tmp_nfa.add_finite_state(p.first);
+	std::string output;
+	switch (mode) {
+		case OUTPUT_COUNT:
+			if (with_filename)
+				output = filename + ':';
+			output += std::to_string(count) + '\n';
+			break;
+		case OUTPUT_FILES:
+			if (count > 0)
+				output = (filename == "-" ? "(standard input)" : filename) + '\n';
+			break;
+		default:
+			break;
 	}
-	nfa2dfa(dst, tmp_nfa, finite_state2fsa_num, INTERSECT);
+	fwrite(output.data(), 1, output.size(), stdout);
+
+	if (count > 0)
+		matched_any = true;
 }
 
-// Subtract of several NFA
-static void subtract_nfa(
-	fsa& dst,
-	const std::vector<fsa> &src)
+// Reports FILE that cannot be read, the rest of FILEs are scanned
+static void input_failed(const std::string &filename)
 {
-	std::map<unsigned, unsigned> finite_state2fsa_num;
-	fsa tmp_nfa;
-	copy_nfas(tmp_nfa, finite_state2fsa_num, src);
-	for (std::pair<unsigned, unsigned> p: finite_state2fsa_num) {
-		tmp_nfa.add_finite_state(p.first);
-	}
-	nfa2dfa(dst, tmp_nfa, finite_state2fsa_num, SUBTRACT);
+	warn("%s", filename.c_str());
+	input_error = true;
 }
 
-// Functions for debugging
-static void print_vector(const set_uint &s)
+static match_context block_context;
+
+// Input is matched by blocks as it is read, blocks are not aligned
+// to lines. Complete lines are matched in place, unfinished line is
+// fed to matcher by parts, so it is never scanned again. It is copied
+// for output only.
+static globmatch_stream pending_stream;
+static bool line_pending = false; // unfinished line is being fed
+static std::string pending_line;
+
+// Unfinished line is complete
+static void pending_line_end(match_context &ctx)
 {
-	for (unsigned v: s) {
-		debug << ' ' << v;
+	int result = matcher->end(pending_stream);
+	line_pending = false;
+	if (!result)
+		return;
+
+	line_matched(ctx);
+	if (mode == OUTPUT_LINES && only_matching) {
+		size_t begin, match_end;
+		result = matcher->find(pending_line.data(), pending_line.size(), &begin, &match_end);
+		output_part(ctx.output, line_prefix,
+			pending_line.data() + begin, match_end - begin, result);
+	} else if (mode == OUTPUT_LINES) {
+		output_line(ctx.output, line_prefix, pending_line.data(), pending_line.size(),
+			pending_line.data() + pending_line.size(), result);
 	}
+	// output may reference pending_line
+	ctx.output.flush(STDOUT_FILENO);
 }
 
-static void print_fsa(fsa &_fsa)
+// -q and -l need nothing but a match, so unfinished line is counted
+// as soon as feed() knows it matches. --follow does not wait for
+// the end of such line then.
+static bool pending_line_decided(bool known)
 {
-	debug << "state count: " << _fsa.get_state_count() << '\n';
-
-	debug << "initial states:";
-	print_vector(_fsa.get_initial_states());
-	debug << '\n';
-
-	debug << "finite states:";
-	print_vector(_fsa.get_finite_states());
-	debug << '\n';
-
-	debug << "input weights:";
-	print_vector(_fsa.get_iws());
-	debug << '\n';
-
-//	debug << "finite states2:\n";
-//	for (unsigned i = 0; i < _fsa.get_state_count(); ++i) {
-//		debug << " state " << i << " is finite: " << _fsa.is_finite_state(i) << '\n';
-//	}
-
-	debug << "arcs:\n";
-	for (unsigned from = 0; from < _fsa.get_state_count(); ++from) {
-		for (const iw_to& iwto: _fsa.get_arcs(from)) {
-			unsigned iw = iwto.iw;
-			unsigned to = iwto.to;
-			char iwc = isalnum(iw) ? (char)iw : ' ';
-			debug << ' ' << from << ' ' << iw << '/' << iwc << ' ' << to << '\n';
-		}
-	}
+	return known && pending_stream.result != 0 &&
+		(mode == OUTPUT_QUIET || mode == OUTPUT_FILES);
 }
 
-// Deterministic Finite State Automaton used during match
-// Initial state is 0.
-class fast_dfa {
-protected:
-	unsigned *m_arcs = nullptr;
-
-private:
-	unsigned m_state_count;
-	unsigned m_iw_count;
-	unsigned m_initial_state;
-	unsigned m_first_finite_state;
+// Returns non-zero when the rest of input is not needed.
+// buffer is nullptr at the end of input.
+static int match_block(const char *buffer, size_t size)
+{
+	match_context &ctx = block_context;
+	const char *end = buffer + size;
 
-	void process_completely_finite_states()
-	{
-		for (unsigned state = 0; state < m_state_count; ++state) {
-			//debug << "curr_state: " << state << '\n';
-			bool loop = true;
-			for (unsigned iw = 0; iw < m_iw_count; ++iw) {
-				if (m_arcs[state * m_iw_count + iw] != state) {
-					//debug << "  no\n";
-					loop = false;
-					break;
-				}
-			}
-			if (loop) {
-				for (unsigned iw = 0; iw < m_iw_count; ++iw) {
-					m_arcs[state * m_iw_count + iw] = -2;
-				}
-			}
-		}
+	if (!buffer) {
+		if (line_pending)
+			pending_line_end(ctx);
+		return ctx.count >= ctx.limit;
 	}
 
-	// too lazy to implement them
-	fast_dfa& operator= (const fast_dfa &) = delete;
-	fast_dfa& operator= (fast_dfa &&) = delete;
-	fast_dfa(const fast_dfa &) = delete;
-	fast_dfa(fast_dfa &&) = delete;
-
-protected:
-	unsigned calc_iw_count(const fsa &dfa) const
-	{
-		unsigned ret = 0;
-		for (unsigned iw: dfa.get_iws()) {
-			if (iw >= ret)
-				ret = iw + 1;
+	// the rest of unfinished line
+	if (line_pending) {
+		const char *eol = (const char *) memchr(buffer, '\n', size);
+		const char *part_end = (eol ? eol : end);
+		// the line is not needed if it is known to be rejected
+		bool known = matcher->feed(pending_stream, buffer, part_end - buffer);
+		if (!known || pending_stream.result != 0) {
+			if (mode == OUTPUT_LINES)
+				pending_line.append(buffer, part_end - buffer);
 		}
-
-		return ret;
-	}
-
-public:
-	fast_dfa() noexcept {}
-
-	~fast_dfa()
-	{
-		clear();
+		if (pending_line_decided(known)) {
+			pending_line_end(ctx);
+			return 1;
+		}
+		if (!eol)
+			return 0;
+		pending_line_end(ctx);
+		buffer = eol + 1;
 	}
 
-	void clear()
-	{
-		delete [] m_arcs;
-		m_arcs = nullptr;
+	const char *last_eol = (const char *) memrchr(buffer, '\n', end - buffer);
+	if (last_eol && ctx.count < ctx.limit) {
+		match_buffer_func(ctx, line_prefix, buffer, last_eol + 1 - buffer);
+		buffer = last_eol + 1;
 	}
 
-	// Convert slow 'fsa' to fast 'fast_dfa'
-	void set(
-		const fsa &dfa,
-		unsigned iw_count = (unsigned)-1,
-		unsigned state_count = (unsigned) -1)
-	{
-		clear();
-
-		const set_uint& iws = dfa.get_iws();
-
-		// set m_state_count
-		if (state_count == (unsigned)-1)
-			m_state_count = (unsigned)dfa.get_state_count();
-		else
-			m_state_count = state_count;
-
-		// calculating m_iw_count which is max input weight + 1
-		if (iw_count == (unsigned)-1)
-			m_iw_count = calc_iw_count(dfa);
-		else
-			m_iw_count = iw_count;
-
-		// optimize finite states by moving them to the right of
-		// non-finite states
-		std::vector<unsigned> state_map;
-		state_map.resize(m_state_count);
-
-		m_first_finite_state = m_state_count - dfa.get_finite_states().size();
-		unsigned current_finite_state = m_first_finite_state;
-		unsigned current_nonfinite_state = 0;
-		for (unsigned state = 0; state < m_state_count; ++state) {
-			if (dfa.is_finite_state(state)) {
-				state_map[state] = current_finite_state++;
-			} else {
-				state_map[state] = current_nonfinite_state++;
-			}
+	if (buffer < end && ctx.count < ctx.limit) {
+		matcher->begin(pending_stream);
+		line_pending = true;
+		bool known = matcher->feed(pending_stream, buffer, end - buffer);
+		if (mode == OUTPUT_LINES)
+			pending_line.assign(buffer, end - buffer);
+		if (pending_line_decided(known)) {
+			pending_line_end(ctx);
+			return 1;
 		}
-		if (dfa.is_finite_state(0))
-			m_initial_state = m_first_finite_state;
-		else
-			m_initial_state = 0;
-
-		// from_state * iws -> to_state matrix.
-		// to state == -1 means "no arc"
-		m_arcs = new unsigned[m_state_count * m_iw_count];
-		memset(m_arcs, -1, m_state_count * m_iw_count * sizeof(m_arcs[0]));
-
-		for (unsigned from = 0; from < m_state_count; ++from) {
-			const vector_iwto& outgoing_arcs = dfa.get_arcs(from);
+	}
 
-			for (unsigned i = 0; i < outgoing_arcs.size(); ++i) {
-				unsigned iw = outgoing_arcs[i].iw;
-				unsigned to = outgoing_arcs[i].to;
-				m_arcs[state_map[from] * m_iw_count + iw] = state_map[to];
-			}
-		}
+	ctx.output.flush(STDOUT_FILENO);
+	return ctx.count >= ctx.limit;
+}
 
-		process_completely_finite_states();
+// Single-threaded matching of a single file
+static void match_file(const std::string &filename)
+{
+	block_context.limit = input_limit();
+	if (block_context.limit > 0 &&
+		file_read_blocks_until(match_block, filename.c_str()) == -1)
+	{
+		input_failed(filename);
+		return;
 	}
+	report_input(filename, block_context.count);
+}
 
-	inline int get_arc(int state, unsigned iw) const noexcept {
-		return m_arcs[state * m_iw_count + iw];
-	}
+// Outputs of tasks (chunks or files) that are written in order of tasks
+// as soon as they are ready, so results never interleave.
+class ordered_output {
+private:
+	struct item {
+		match_context ctx;
+		bool done = false;
+	};
 
-	inline void set_arc(int from, unsigned iw, int to) const noexcept {
-		assert(iw < m_iw_count);
-		assert(from < m_state_count);
-		assert(to >= -2 && to < (int)m_state_count);
-		m_arcs[from * m_iw_count + iw] = to;
-	}
+	std::vector<item> m_items;
+	std::mutex m_mutex;
+	std::condition_variable m_done_cond;
+	size_t m_next = 0; // task whose result write() waits for
 
-	inline bool is_finite_state(int state) const noexcept {
-		return state >= m_first_finite_state;
-	}
+public:
+	ordered_output(size_t count) : m_items(count) {}
 
-	inline unsigned get_initial_state() const noexcept {
-		return m_initial_state;
+	match_context& get(size_t idx)
+	{
+		return m_items[idx].ctx;
 	}
 
-	inline unsigned get_state_count() const noexcept {
-		return m_state_count;
+	void set_done(size_t idx)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_items[idx].done = true;
+		m_done_cond.notify_all();
 	}
 
-	inline unsigned get_iw_count() const noexcept {
-		return m_iw_count;
+	// Returns true if result of task idx is written as soon as it is done
+	bool is_next(size_t idx)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_next == idx;
 	}
 
-	inline unsigned get_first_finite_state() const noexcept {
-		return m_first_finite_state;
+	// Passes results to consume() in order of tasks
+	void write(std::function<void(size_t, match_context&)> consume)
+	{
+		for (size_t idx = 0; idx < m_items.size(); ++idx) {
+			item &i = m_items[idx];
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_next = idx;
+			m_done_cond.wait(lock, [&i] { return i.done; });
+			lock.unlock();
+
+			consume(idx, i.ctx);
+			i.ctx.output = output_buffer();
+		}
 	}
 };
 
-// The same as fast_dfa but uses shift instead of multiplication in
-// get_arc method
-class fast_dfa_shift: public fast_dfa {
+// Pool of threads running tasks 0, 1, ..., task_count-1.
+// Tasks are distributed among per-thread deques by contiguous ranges.
+// Thread takes tasks from the front of its own deque, idle thread
+// steals from the back of the most loaded deque of other threads.
+class work_stealing_pool {
 private:
-	unsigned m_iw_shift;
+	struct task_queue {
+		std::mutex mutex;
+		std::deque<size_t> tasks;
+	};
 
-public:
-	// Convert slow 'fsa' to fast 'fast_dfa'
-	void set(const fsa &dfa, unsigned state_count = (unsigned)-1)
-	{
-		unsigned iw_count = nextpow2(calc_iw_count(dfa) - 1);
-		m_iw_shift = 31 - __builtin_clz(iw_count);
-		fast_dfa::set(dfa, iw_count, state_count);
-	}
+	std::vector<std::unique_ptr<task_queue>> m_queues;
+	std::vector<std::thread> m_threads;
+	std::function<void(size_t)> m_task;
 
-	inline int get_arc(int state, unsigned iw) const noexcept {
-		return m_arcs[(state << m_iw_shift) + iw];
+	bool pop(unsigned thread_num, size_t &task)
+	{
+		task_queue &q = *m_queues[thread_num];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (q.tasks.empty())
+			return false;
+
+		task = q.tasks.front();
+		q.tasks.pop_front();
+		return true;
 	}
-};
 
-// Build NFA from glob pattern
-static void parse_glob(fsa &nfa, const char *glob)
-{
-	std::set<unsigned> iws;
-	for (const char *p = glob; *p; ++p) {
-		unsigned iw = (unsigned) (unsigned char) *p;
-		if (iw != '*' && iw != '?')
-			iws.insert(iw);
-	}
-
-	//
-	unsigned current_state = 0;
-	nfa.add_initial_state(0);
-	for (const char *p = glob; *p; ++p) {
-		unsigned curr_iw = (unsigned) (unsigned char) *p;
-		unsigned addon;
-		switch (curr_iw) {
-			case '*':
-			case '?':
-				addon = (curr_iw == '?');
-				// iw == 0 means all possible ASCII characters except seen in glob pattern
-				nfa.add_arc(current_state, 0, current_state + addon);
-				for (unsigned iw: iws)
-					nfa.add_arc(current_state, iw, current_state + addon);
-				current_state += addon;
-				break;
-			default:
-				nfa.add_arc(current_state, curr_iw, current_state + 1);
-				++current_state;
+	bool steal(unsigned thread_num, size_t &task)
+	{
+		while (true) {
+			unsigned victim = thread_num;
+			size_t victim_size = 0;
+			for (unsigned i = 0; i < m_queues.size(); ++i) {
+				std::lock_guard<std::mutex> lock(m_queues[i]->mutex);
+				if (m_queues[i]->tasks.size() > victim_size) {
+					victim = i;
+					victim_size = m_queues[i]->tasks.size();
+				}
+			}
+			if (victim_size == 0)
+				return false;
+
+			task_queue &q = *m_queues[victim];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (!q.tasks.empty()) {
+				task = q.tasks.back();
+				q.tasks.pop_back();
+				return true;
+			}
 		}
 	}
-	nfa.add_finite_state(current_state);
-}
 
-// Interface class for DFA-based matcher
-class dfa_matcher_i {
-public:
-	virtual void set_nfa(const fsa& nfa) = 0;
-	virtual int match(const char *buffer, size_t buffer_size) = 0;
-};
-
-// Class for DFA-based matcher with weight mapping
-class dfa_matcher_iwmap_base: public dfa_matcher_i {
-protected:
-	uint8_t *m_iw_map = nullptr;  // map symbols used in regexp to 1, 2 etc., map others to 0
-	unsigned m_iw_map_size = 0;
-
-public:
-	dfa_matcher_iwmap_base() = default;
-	virtual ~dfa_matcher_iwmap_base()
+	void worker(unsigned thread_num)
 	{
-		delete [] m_iw_map;
-		m_iw_map = nullptr;
+		size_t task;
+		while (pop(thread_num, task) || steal(thread_num, task))
+			m_task(task);
 	}
 
-	// too lazy to implement them
-	dfa_matcher_iwmap_base& operator= (const dfa_matcher_iwmap_base &) = delete;
-	dfa_matcher_iwmap_base& operator= (dfa_matcher_iwmap_base &&) = delete;
-	dfa_matcher_iwmap_base(const dfa_matcher_iwmap_base &) = delete;
-	dfa_matcher_iwmap_base(dfa_matcher_iwmap_base &&) = delete;
-
-protected:
-	void build_iw_map(fsa& dst_fsa, const fsa& src_nfa)
+public:
+	void start(
+		unsigned thread_count, size_t task_count,
+		std::function<void(size_t)> task)
 	{
-		dst_fsa.clear();
-
-		m_iw_map_size = 256;
-		m_iw_map = new uint8_t[m_iw_map_size];
-		memset(m_iw_map, 0, m_iw_map_size * sizeof(m_iw_map[0]));
-
-		unsigned *temp_iw_map = build_iwmap(dst_fsa, m_iw_map_size, src_nfa);
-
-		for (unsigned i = 0; i < m_iw_map_size; ++i) {
-			m_iw_map[i] = temp_iw_map[i];
+		m_task = task;
+
+		for (unsigned i = 0; i < thread_count; ++i) {
+			m_queues.emplace_back(new task_queue);
+			size_t first = task_count * i / thread_count;
+			size_t last = task_count * (i + 1) / thread_count;
+			for (size_t t = first; t < last; ++t)
+				m_queues.back()->tasks.push_back(t);
 		}
 
-		delete [] temp_iw_map;
+		for (unsigned i = 0; i < thread_count; ++i)
+			m_threads.emplace_back(&work_stealing_pool::worker, this, i);
+	}
 
-//		print_fsa(dst_fsa);
+	void join()
+	{
+		for (std::thread &t: m_threads)
+			t.join();
+		m_threads.clear();
+		m_queues.clear();
 	}
 };
 
-// Class used for matching using DFA with iwmap
-template <typename DFAType>
-class dfa_matcher_iwmap : public dfa_matcher_iwmap_base {
-private:
-	// glob pattern
-	DFAType m_fast_dfa;
-
-public:
-	dfa_matcher_iwmap() = default;
+// Multi-threaded matching of a single file.
+// Input is split into newline-aligned chunks that are matched
+// by a pool of threads. Matched lines are written in original order.
+static void match_chunked(const char *filename, unsigned thread_count)
+{
+	static const size_t min_chunk_size = 1024 * 1024;
 
-	~dfa_matcher_iwmap() { }
+	file_buffer fb;
+	if (file_buffer_open(&fb, filename) == -1) {
+		input_failed(filename);
+		return;
+	}
 
-	virtual void set_nfa(const fsa& nfa)
-	{
-		m_fast_dfa.clear();
+	// several chunks per thread for better load balancing
+	size_t chunk_size = fb.size / (thread_count * 8) + 1;
+	if (chunk_size < min_chunk_size)
+		chunk_size = min_chunk_size;
+
+	std::vector<std::pair<const char *, size_t>> chunks;
+	const char *buffer = fb.data;
+	const char *end = fb.data + fb.size;
+	while (buffer < end) {
+		const char *chunk_end = end;
+		if ((size_t)(end - buffer) > chunk_size) {
+			chunk_end = (const char *) memchr(
+				buffer + chunk_size, '\n', end - buffer - chunk_size);
+			chunk_end = (chunk_end ? chunk_end + 1 : end);
+		}
 
-		fsa nfa_iwmap;
-		build_iw_map(nfa_iwmap, nfa);
+		chunks.push_back(std::make_pair(buffer, chunk_end - buffer));
+		buffer = chunk_end;
+	}
 
-		fsa dfa;
-		nfa2mindfa(dfa, nfa_iwmap);
+	// chunks after stop_chunk are not needed, the answer is known
+	std::atomic<size_t> stop_chunk((size_t)-1);
+	size_t limit = input_limit();
+
+	ordered_output output(chunks.size());
+	work_stealing_pool pool;
+	pool.start(thread_count, chunks.size(), [&](size_t idx) {
+		match_context &ctx = output.get(idx);
+		if (idx <= stop_chunk) {
+			ctx.limit = limit;
+			match_buffer_func(ctx, line_prefix,
+				chunks[idx].first, chunks[idx].second);
+
+			// chunk alone has enough lines
+			size_t stop = stop_chunk;
+			while (ctx.count >= limit && idx < stop &&
+				!stop_chunk.compare_exchange_weak(stop, idx))
+			{
+			}
+		}
+		output.set_done(idx);
+	});
+
+	// limit is applied to every chunk, so it is applied again
+	size_t count = 0;
+	output.write([&](size_t, match_context &ctx) {
+		size_t take = std::min(ctx.count, limit - count);
+		if (take < ctx.count)
+			ctx.output.truncate_lines(take);
+		ctx.output.flush(STDOUT_FILENO);
+		count += take;
+	});
+	pool.join();
+	report_input(filename, count);
+
+	file_buffer_close(&fb);
+}
 
-//		print_fsa(dfa);
+// Multi-threaded matching of several files. The DFA is shared by all
+// threads, every file is matched by one thread to its own output buffer.
+// Output references file contents, so the file written next is closed
+// after writing. Output of other files is copied and they are closed
+// at once, so that a slow file does not keep the rest mapped.
+// Files that cannot be read are reported in order and skipped.
+static void match_files(
+	const std::vector<std::string> &filenames, unsigned thread_count)
+{
+	ordered_output output(filenames.size());
+	std::vector<file_buffer> buffers(filenames.size());
+	work_stealing_pool pool;
+	pool.start(thread_count, filenames.size(), [&](size_t idx) {
+		const std::string &filename = filenames[idx];
+		match_context &ctx = output.get(idx);
+		file_buffer &fb = buffers[idx];
+		ctx.limit = input_limit();
+		if (ctx.limit > 0 && file_buffer_open(&fb, filename.c_str()) == -1) {
+			ctx.error = errno;
+		} else if (ctx.limit > 0) {
+			match_buffer_func(ctx,
+				(with_filename ? filename + ':' : std::string()),
+				fb.data, fb.size);
+			if (mode != OUTPUT_LINES || !output.is_next(idx)) {
+				ctx.output.detach();
+				file_buffer_close(&fb);
+			}
+		}
+		output.set_done(idx);
+	});
+	output.write([&](size_t idx, match_context &ctx) {
+		ctx.output.flush(STDOUT_FILENO);
+		file_buffer_close(&buffers[idx]);
+		if (ctx.error) {
+			errno = ctx.error;
+			input_failed(filenames[idx]);
+		} else {
+			report_input(filenames[idx], ctx.count);
+		}
+	});
+	pool.join();
+}
 
-		//
-		m_fast_dfa.set(dfa);
+// Adds filename to the list of files to scan.
+// Directories are scanned recursively if recursive is true.
+// Files and directories that cannot be read are reported and skipped.
+static void add_file(
+	std::vector<std::string> &filenames,
+	const std::string &filename, bool recursive, bool command_line)
+{
+	struct stat st;
+	int ret = (command_line ? stat(filename.c_str(), &st) : lstat(filename.c_str(), &st));
+	if (ret == -1) {
+		input_failed(filename);
+		return;
 	}
 
-	virtual int match(const char *buffer, size_t buffer_size)
-	{
-		unsigned iw = 0;
-		int state = m_fast_dfa.get_initial_state();
-
-		for (size_t pos = 0; pos < buffer_size; ++pos) {
-			iw = (unsigned) (unsigned char) buffer[pos];
-			iw = m_iw_map[iw];
-			state = m_fast_dfa.get_arc(state, iw);
-			if (state < 0)
-				return state + 1;
-		}
+	if (!S_ISDIR(st.st_mode)) {
+		// symbolic links found during recursive scan are ignored
+		if (command_line || S_ISREG(st.st_mode))
+			filenames.push_back(filename);
+		return;
+	}
 
-		return m_fast_dfa.is_finite_state(state);
+	if (!recursive) {
+		errno = EISDIR;
+		input_failed(filename);
+		return;
 	}
-};
 
-static dfa_matcher_i *matcher;
+	DIR *dir = opendir(filename.c_str());
+	if (!dir) {
+		input_failed(filename);
+		return;
+	}
 
-static void match(const char *line, size_t line_len)
-{
-	if (matcher->match(line, line_len)){
-		fwrite(line, 1, line_len, stdout);
-		fputc('\n', stdout);
+	std::vector<std::string> entries;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != nullptr) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		entries.push_back(entry->d_name);
+	}
+	closedir(dir);
+
+	std::sort(entries.begin(), entries.end());
+	for (const std::string &name: entries) {
+		std::string path = filename;
+		if (path.empty() || path.back() != '/')
+			path += '/';
+		add_file(filenames, path + name, true, false);
 	}
 }
 
 static void usage()
 {
 	fprintf(stderr, "usage: my_grep [OPTIONS] GLOB_PATTERNs FILE\n\
-where PATTERN is a glob pattern like apple* or a??le\n\
+       my_grep [OPTIONS] -e GLOB_PATTERN... [FILEs]\n\
+where PATTERN is a glob pattern like apple*, a??le, [a-c]*[!0-9]\n\
+or [[:digit:]]\\*, where \\ escapes the next character\n\
 and FILE is a filename to scan.\n\
 \n\
 OPTIONS:\n\
@@ -848,8 +870,45 @@ OPTIONS:\n\
    -Wu    --    union of several glob patterns\n\
    -Wi    --    intersection of several glob patterns\n\
    -Ws    --    subtraction of several glob patterns\n\
+   -We    --    boolean expression of glob patterns, GLOB_PATTERNs\n\
+                are joined with spaces, e.g., '(a* & *b) | !*tmp*',\n\
+                ! is negation, & is conjunction, | is disjunction\n\
+   -Mb    --    minimize DFA with Brzozowski algorithm\n\
+   -Mh    --    minimize DFA with Hopcroft algorithm (default)\n\
+   -Ml[N] --    build DFA lazily while matching, with N bytes\n\
+                per thread for DFA states (default 8MiB)\n\
+   -e PAT --    glob pattern, may be repeated,\n\
+                all other arguments are FILEs\n\
+   -r     --    scan directories recursively\n\
+   -H     --    prefix output lines with filename,\n\
+                default if several FILEs are given or -r is used\n\
+   -j N   --    scan FILE(s) by N threads\n\
+   -B     --    match several lines simultaneously\n\
+   -C DIR --    cache compiled DFA in directory DIR\n\
+   -p     --    prefix output lines with comma-separated numbers\n\
+                (starting from 0) of matched patterns, -Wu only, without -v\n\
+   -c     --    output the number of matched lines for every FILE\n\
+   -l     --    output names of FILEs with matched lines\n\
+   -q     --    output nothing, exit on the first matched line\n\
+   -m N   --    stop reading FILE after N matched lines\n\
+   -v     --    select lines NOT matching GLOB_PATTERNs\n\
+   -i     --    ignore case of ASCII letters\n\
+   -u     --    GLOB_PATTERNs match any part of line, e.g.,\n\
+                foo works like *foo*\n\
+   -o     --    output the first matched part of line only,\n\
+                the whole line without -u, -Wu only, without -v\n\
+   -T FILE --   lay out DFA states for faster matching of input\n\
+                like FILE, e.g., the head of input\n\
+   -S N   --    consume N (1, 2 or 4) bytes per DFA step\n\
+                if matrix of arcs is small enough\n\
+   --follow --  keep reading the only FILE as it grows like tail -f,\n\
+                truncated or replaced (rotated) FILE is read again\n\
+                from the beginning, -c is not allowed\n\
 \n\
 If FILE is '-', than stdin is read\n\
+Exit status is 0 if a line is matched and 1 otherwise.\n\
+FILEs that cannot be read are reported and skipped, exit status\n\
+is 2 then unless -q has matched a line\n\
 \n\
 Examples:\n\
    my_grep 'apple*' /usr/share/dict/words\n\
@@ -857,16 +916,37 @@ Examples:\n\
    my_grep -Wu 'apple*' '*apple' /usr/share/dict/words\n\
    my_grep -Wi '*app*' '*pie*' /usr/share/dict/words\n\
    my_grep -Wi 'comp*' '*ing' /usr/share/dict/words\n\
-   my_grep -Ws 'apple*' 'apple' 'apples' /usr/share/dict/words\n");
+   my_grep -Ws 'apple*' 'apple' 'apples' /usr/share/dict/words\n\
+   my_grep -We '(*app* & *pie*) | !*e*' /usr/share/dict/words\n\
+   my_grep -j 8 '*a*b*c*d*' /usr/share/dict/words\n\
+   my_grep -j 8 -r -e '*error*' /var/log\n\
+   my_grep -p -e '*error*' -e '*warning*' /var/log/messages\n");
 }
 
+// long options without short equivalent
+enum {
+	OPT_FOLLOW = 256,
+};
+
+static const struct option long_options[] = {
+	{"follow", no_argument, nullptr, OPT_FOLLOW},
+	{nullptr, 0, nullptr, 0},
+};
+
 int main(int argc, char **argv)
 {
 	int opt;
 
-	fsa_operation op = UNION;
+	globmatch_options options;
+	unsigned thread_count = 1;
+	bool recursive = false;
+	const char *train_file = nullptr;
+	bool follow = false;
+	std::vector<std::string> globs;
 
-	while ((opt = getopt(argc, argv, "+hW:")) != -1) {
+	while ((opt = getopt_long(argc, argv, "+hW:M:e:rHj:BC:pclqm:viuoT:S:",
+		long_options, nullptr)) != -1)
+	{
 		switch (opt) {
 			case 'h':
 				usage();
@@ -874,62 +954,194 @@ int main(int argc, char **argv)
 			case 'W':
 				switch (optarg[0]) {
 					case 'u':
-						op = UNION;
+						options.operation = GLOBMATCH_UNION;
 						break;
 					case 'i':
-						op = INTERSECT;
+						options.operation = GLOBMATCH_INTERSECT;
 						break;
 					case 's':
-						op = SUBTRACT;
+						options.operation = GLOBMATCH_SUBTRACT;
+						break;
+					case 'e':
+						options.operation = GLOBMATCH_EXPRESSION;
+						break;
+					default:
+						usage();
+						exit(1);
+				}
+				break;
+			case 'M':
+				switch (optarg[0]) {
+					case 'b':
+						options.minimization = GLOBMATCH_BRZOZOWSKI;
+						break;
+					case 'h':
+						options.minimization = GLOBMATCH_HOPCROFT;
+						break;
+					case 'l':
+						options.lazy = true;
+						if (optarg[1])
+							options.lazy_cache_size = strtoul(optarg + 1, nullptr, 10);
 						break;
 					default:
 						usage();
 						exit(1);
 				}
 				break;
+			case 'e':
+				globs.push_back(optarg);
+				break;
+			case 'r':
+				recursive = true;
+				break;
+			case 'H':
+				with_filename = true;
+				break;
+			case 'B':
+				match_buffer_func = match_buffer_batch;
+				break;
+			case 'C':
+				options.cache_dir = optarg;
+				break;
+			case 'p':
+				options.pattern_ids = true;
+				print_pattern_ids = true;
+				break;
+			case 'c':
+				mode = OUTPUT_COUNT;
+				break;
+			case 'l':
+				mode = OUTPUT_FILES;
+				break;
+			case 'q':
+				mode = OUTPUT_QUIET;
+				break;
+			case 'm':
+				max_count = strtoul(optarg, nullptr, 10);
+				break;
+			case 'v':
+				options.invert = true;
+				break;
+			case 'i':
+				options.ignore_case = true;
+				break;
+			case 'u':
+				options.unanchored = true;
+				break;
+			case 'o':
+				only_matching = true;
+				break;
+			case 'T':
+				train_file = optarg;
+				break;
+			case 'S':
+				options.stride = atoi(optarg);
+				if (options.stride != 1 && options.stride != 2 && options.stride != 4) {
+					usage();
+					exit(1);
+				}
+				break;
+			case OPT_FOLLOW:
+				follow = true;
+				break;
+			case 'j':
+				thread_count = atoi(optarg);
+				if (thread_count == 0) {
+					usage();
+					exit(1);
+				}
+				break;
 			default:
 				usage();
 				exit(1);
 		}
 	}
 
-	argc -= optind;
-	argv += optind;
-
-	if (argc < 2) {
+	if ((options.pattern_ids || only_matching) &&
+		(options.operation != GLOBMATCH_UNION || options.invert))
+	{
 		usage();
 		exit(1);
 	}
 
-	std::vector<fsa> nfas;
-	nfas.resize(argc - 1);
-	for (unsigned i = 0; i < argc - 1; ++i) {
-		parse_glob(nfas[i], argv[i]);
+	argc -= optind;
+	argv += optind;
+
+	std::vector<char *> file_args;
+	if (globs.empty()) {
+		if (argc < 2) {
+			usage();
+			exit(1);
+		}
+
+		globs.assign(argv, argv + argc - 1);
+		file_args.push_back(argv[argc - 1]);
+	} else {
+		file_args.assign(argv, argv + argc);
+		if (file_args.empty())
+			file_args.push_back((char *) "-");
 	}
 
-	fsa nfa;
-	switch (op) {
-		case UNION:
-			union_nfa(nfa, nfas);
-			break;
-		case INTERSECT:
-			intersect_nfa(nfa, nfas);
-			break;
-		case SUBTRACT:
-			subtract_nfa(nfa, nfas);
-			break;
-		default:
-			abort();
+	std::vector<std::string> filenames;
+	for (const char *file_arg: file_args) {
+		if (!strcmp(file_arg, "-"))
+			filenames.push_back(file_arg);
+		else
+			add_file(filenames, file_arg, recursive, true);
 	}
 
-	//	print_fsa(nfa);
+	if (file_args.size() > 1 || recursive)
+		with_filename = true;
 
-//	dfa_matcher_iwmap<fast_dfa> matcher_iwmap;
-	dfa_matcher_iwmap<fast_dfa_shift> matcher_iwmap;
-	matcher_iwmap.set_nfa(nfa);
-	matcher = &matcher_iwmap;
+	if (follow && (filenames.size() > 1 || mode == OUTPUT_COUNT)) {
+		usage();
+		exit(1);
+	}
+
+	file_buffer train_fb;
+	if (train_file) {
+		if (file_buffer_open(&train_fb, train_file) == -1)
+			err(1, "%s", train_file);
+		options.train_data = train_fb.data;
+		options.train_size = train_fb.size;
+	}
 
-	file_match2(match, argv[argc - 1]);
+	// DFA is compiled once for all files
+	std::string error;
+	std::unique_ptr<const globmatch> compiled = globmatch_compile(globs, options, &error);
+	if (!compiled)
+		errx(1, "%s", error.c_str());
+	matcher = compiled.get();
+
+	if (train_file)
+		file_buffer_close(&train_fb);
+
+	if (filenames.empty()) {
+		// every FILE is skipped
+	} else if (follow) {
+		if (with_filename)
+			line_prefix = filenames[0] + ':';
+		block_context.limit = input_limit();
+		if (block_context.limit > 0 &&
+			file_follow(match_block, filenames[0].c_str()) == -1)
+		{
+			input_failed(filenames[0]);
+		} else {
+			report_input(filenames[0], block_context.count);
+		}
+	} else if (filenames.size() == 1 && thread_count == 1) {
+		if (with_filename)
+			line_prefix = filenames[0] + ':';
+		match_file(filenames[0]);
+	} else if (filenames.size() == 1) {
+		if (with_filename)
+			line_prefix = filenames[0] + ':';
+		match_chunked(filenames[0].c_str(), thread_count);
+	} else {
+		match_files(filenames, thread_count);
+	}
 
-	return 0;
+	if (input_error)
+		return 2;
+	return matched_any ? 0 : 1;
 }